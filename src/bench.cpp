@@ -0,0 +1,312 @@
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include "ever.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+template<typename Fn>
+void report(const char* name, long long count, Fn fn) {
+  auto start = bench_clock::now();
+  long long sink = fn(count);
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+  std::cout << name
+    << ": " << double(elapsed) / count << "ns/op"
+    << " (" << count << " ops, " << elapsed / 1000000 << "ms)"
+    << " [" << (sink & 1) << "]"
+    << std::endl;
+}
+
+void bench_now(long long count) {
+  std::cout << "fast_clock uses tsc: " << ever::fast_clock::uses_tsc() << std::endl;
+  report("instant::now", count, [](long long n) {
+    long long sum = 0;
+    for (long long i = 0; i < n; i++) {
+      sum += ever::instant::now().unix();
+    }
+    return sum;
+  });
+  report("instant::now_coarse", count, [](long long n) {
+    long long sum = 0;
+    for (long long i = 0; i < n; i++) {
+      sum += ever::instant::now_coarse().unix();
+    }
+    return sum;
+  });
+  report("fast_clock::now", count, [](long long n) {
+    long long sum = 0;
+    for (long long i = 0; i < n; i++) {
+      sum += ever::fast_clock::now().unix();
+    }
+    return sum;
+  });
+  report("fast_clock::now_nanos", count, [](long long n) {
+    long long sum = 0;
+    for (long long i = 0; i < n; i++) {
+      sum += ever::fast_clock::now_nanos();
+    }
+    return sum;
+  });
+}
+
+void bench_format(long long count) {
+  long long base = ever::instant{2020, 7, 14, 0, 0, 0}.unix() * 1000;
+  ever::formatter fmt;
+  report("formatter::format_to", count, [&](long long n) {
+    char buf[64];
+    long long sum = 0;
+    for (long long i = 0; i < n; i++) {
+      long long ms = base + i * 7;
+      sum += fmt.format_to(buf, sizeof(buf), ever::instant{ms / 1000, int(ms % 1000)}) + buf[22];
+    }
+    return sum;
+  });
+  ever::stream_formatter stream;
+  report("stream_formatter::format", count, [&](long long n) {
+    long long sum = 0;
+    for (long long i = 0; i < n; i++) {
+      long long ms = base + i * 7;
+      sum += stream.format(ever::instant{ms / 1000, int(ms % 1000)})[22];
+    }
+    return sum;
+  });
+}
+
+void bench_parse(long long count) {
+  std::vector<std::string> rows;
+  for (long long i = 0; i < count; i++) {
+    rows.push_back(ever::instant{1594734498LL + i}.format("%Y-%M-%D %h:%m:%s"));
+  }
+  std::vector<std::string_view> views(rows.begin(), rows.end());
+  std::vector<ever::instant> out(rows.size());
+  std::vector<uint64_t> errors((rows.size() + 63) / 64);
+  ever::parser p("%Y-%M-%D %h:%m:%s");
+  for (unsigned threads = 1; threads <= std::thread::hardware_concurrency(); threads *= 2) {
+    std::string name = "parse_batch/" + std::to_string(threads);
+    report(name.c_str(), count, [&](long long n) {
+      return ever::parse_batch(p, views.data(), n, out.data(), errors.data(), threads) + out[n/2].unix();
+    });
+  }
+}
+
+// bench_multi parses rows in several layouts with multi_parser and by
+// trying one parser per pattern in turn, on a mixed stream and on a stream
+// with a single layout.
+void bench_multi(long long count) {
+  std::vector<std::string> patterns{
+    "%Y-%M-%DT%h:%m:%s.%fZ",
+    "%Y-%M-%D %h:%m:%s.%f",
+    "%Y-%M-%DT%h:%m:%s",
+    "%Y-%M-%D %h:%m:%s",
+    "%Y/%j %h:%m:%s",
+    "%Y%M%D",
+    "%Y%j",
+    "%Y-%M-%D",
+  };
+  ever::multi_parser mp(patterns);
+  std::vector<ever::parser> parsers(patterns.begin(), patterns.end());
+  std::vector<std::string> mixed, single;
+  for (long long i = 0; i < count; i++) {
+    ever::instant w{1594734498LL + i * 7919, int(i % 1000)};
+    mixed.push_back(w.format(patterns[(i * 5) % patterns.size()]));
+    single.push_back(w.format(patterns[4]));
+  }
+  for (auto rows: {&mixed, &single}) {
+    const char* kind = rows == &mixed ? "mixed" : "single";
+    std::string name = std::string("multi_parser/") + kind;
+    report(name.c_str(), count, [&](long long n) {
+      long long sum = 0;
+      for (long long i = 0; i < n; i++) {
+        sum += mp.try_parse((*rows)[i]).value.unix();
+      }
+      return sum;
+    });
+    name = std::string("parser in turn/") + kind;
+    report(name.c_str(), count, [&](long long n) {
+      long long sum = 0;
+      for (long long i = 0; i < n; i++) {
+        for (const auto& p: parsers) {
+          auto res = p.try_parse((*rows)[i]);
+          if (res) {
+            sum += res.value.unix();
+            break;
+          }
+        }
+      }
+      return sum;
+    });
+  }
+}
+
+void bench_sort(long long count) {
+  std::vector<ever::instant> values(count);
+  unsigned long long seed = 42;
+  for (auto& w: values) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    w = ever::instant{1500000000LL + static_cast<long long>(seed >> 33) % 300000000, int((seed >> 20) % 1000)};
+  }
+  std::vector<ever::instant> work;
+  report("std::sort", count, [&](long long) {
+    work = values;
+    std::sort(work.begin(), work.end());
+    return work[0].unix();
+  });
+  for (unsigned threads = 1; threads <= std::thread::hardware_concurrency(); threads *= 2) {
+    std::string name = "ever::sort/" + std::to_string(threads);
+    report(name.c_str(), count, [&](long long) {
+      work = values;
+      ever::sort(work.data(), work.size(), threads);
+      return work[0].unix();
+    });
+  }
+}
+
+void bench_add(long long count) {
+  std::vector<ever::instant> values(count), out(count);
+  for (long long i = 0; i < count; i++) {
+    values[i] = ever::instant{1500000000LL + (i / 16) * 3600};
+  }
+  report("instant::add", count, [&](long long n) {
+    for (long long i = 0; i < n; i++) {
+      out[i] = values[i].add(0, -13, -45);
+    }
+    return out[n/2].unix();
+  });
+  report("add_batch", count, [&](long long n) {
+    ever::add_batch(values.data(), n, 0, -13, -45, out.data());
+    return out[n/2].unix();
+  });
+}
+
+void bench_floor(long long count) {
+  std::vector<long long> values(count), out(count);
+  for (long long i = 0; i < count; i++) {
+    values[i] = 1500000000000LL + i * 997;
+  }
+  report("bucket_start/hour", count, [&](long long n) {
+    for (long long i = 0; i < n; i++) {
+      out[i] = ever::bucket_start(values[i], ever::time_unit::hour);
+    }
+    return out[n/2];
+  });
+  report("floor_batch/hour", count, [&](long long n) {
+    ever::floor_batch(values.data(), n, ever::time_unit::hour, out.data());
+    return out[n/2];
+  });
+  report("bucket_start/month", count, [&](long long n) {
+    for (long long i = 0; i < n; i++) {
+      out[i] = ever::bucket_start(values[i], ever::time_unit::month);
+    }
+    return out[n/2];
+  });
+  report("floor_batch/month", count, [&](long long n) {
+    ever::floor_batch(values.data(), n, ever::time_unit::month, out.data());
+    return out[n/2];
+  });
+}
+
+void bench_next(long long count) {
+  const char* exprs[] = {"*/5 * * * *", "0 9 * * MON-FRI", "30 2 L * *", "0 0 1,15 * *", "15 10 * 3,6,9,12 *"};
+  std::vector<ever::recurrence> rules;
+  for (long long i = 0; i < count; i++) {
+    rules.push_back(ever::recurrence::cron(exprs[i % 5]));
+  }
+  std::vector<ever::instant> out(count);
+  ever::instant at{2020, 7, 14, 13, 48, 18};
+  report("next_after", count, [&](long long n) {
+    ever::next_after(rules.data(), n, at, out.data());
+    return out[n/2].unix();
+  });
+}
+
+// bench_wheel schedules count timers over the next minute, cancels half of
+// them and advances the time by 10ms steps until all have fired, with the
+// timer wheel and with a binary heap whose cancelled entries are skipped.
+void bench_wheel(long long count) {
+  ever::instant start{2020, 7, 14, 13, 48, 18};
+  std::vector<ever::instant> deadlines(count);
+  uint64_t seed = 1;
+  for (auto& w: deadlines) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int ms = (seed >> 33) % 60000;
+    w = ever::instant{start.unix() + ms / 1000, ms % 1000};
+  }
+  report("timer_wheel", count, [&](long long n) {
+    ever::timer_wheel wheel{start};
+    std::vector<ever::timer_wheel::timer_id> ids(n);
+    for (long long i = 0; i < n; i++) {
+      ids[i] = wheel.schedule(deadlines[i], i);
+    }
+    for (long long i = 0; i < n; i += 2) {
+      wheel.cancel(ids[i]);
+    }
+    std::vector<ever::timer_wheel::expired> out;
+    long long sum = 0;
+    for (int ms = 10; ms <= 60000; ms += 10) {
+      out.clear();
+      wheel.advance_to(ever::instant{start.unix() + ms / 1000, ms % 1000}, out);
+      for (auto& e: out) {
+        sum += e.data;
+      }
+    }
+    return sum;
+  });
+  report("std::priority_queue", count, [&](long long n) {
+    using entry = std::pair<ever::instant, long long>;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry>> heap;
+    std::vector<bool> cancelled(n);
+    for (long long i = 0; i < n; i++) {
+      heap.emplace(deadlines[i], i);
+    }
+    for (long long i = 0; i < n; i += 2) {
+      cancelled[i] = true;
+    }
+    long long sum = 0;
+    for (int ms = 10; ms <= 60000; ms += 10) {
+      ever::instant w{start.unix() + ms / 1000, ms % 1000};
+      while (!heap.empty() && heap.top().first <= w) {
+        if (!cancelled[heap.top().second]) {
+          sum += heap.top().second;
+        }
+        heap.pop();
+      }
+    }
+    return sum;
+  });
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " <now|format|parse|multi|sort|add|floor|next|wheel> [count]" << std::endl;
+    return 2;
+  }
+  long long count = argc > 2 ? std::stoll(argv[2]) : 10000000;
+  if (!std::strcmp(argv[1], "now")) {
+    bench_now(count);
+  } else if (!std::strcmp(argv[1], "format")) {
+    bench_format(count);
+  } else if (!std::strcmp(argv[1], "parse")) {
+    bench_parse(count);
+  } else if (!std::strcmp(argv[1], "multi")) {
+    bench_multi(count);
+  } else if (!std::strcmp(argv[1], "sort")) {
+    bench_sort(count);
+  } else if (!std::strcmp(argv[1], "add")) {
+    bench_add(count);
+  } else if (!std::strcmp(argv[1], "floor")) {
+    bench_floor(count);
+  } else if (!std::strcmp(argv[1], "next")) {
+    bench_next(count);
+  } else if (!std::strcmp(argv[1], "wheel")) {
+    bench_wheel(count);
+  } else {
+    std::cerr << "unknown benchmark: " << argv[1] << std::endl;
+    return 2;
+  }
+}
@@ -0,0 +1,287 @@
+// ever-convert rewrites the timestamps of a column of a text file from one
+// pattern to another.
+//
+//   ever-convert [-j threads] [-d delimiter] [-c column] -i input -o output file [outfile]
+//
+// The file is mapped in memory and cut on line boundaries into chunks that
+// the workers convert concurrently. The chunks are written in order as soon
+// as they are ready, so the output is the same as with a single thread.
+// Lines whose column can not be parsed are copied unchanged. Without a
+// delimiter the whole line is the column.
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ever.h"
+
+struct options {
+  std::string input;
+  std::string output;
+  char delimiter = 0;
+  int column = 1;
+  unsigned threads = 0;
+  size_t chunk = 4 << 20;
+};
+
+struct chunk {
+  const char* first;
+  const char* last;
+  std::string out;
+  bool done = false;
+};
+
+class converter {
+public:
+  converter(const options &opts, const char* data, size_t size);
+
+  int run(int fd);
+
+private:
+  const options &opts;
+  ever::parser parser;
+  std::vector<chunk> chunks;
+
+  // window limits the number of chunks converted but not yet written.
+  size_t window;
+  std::atomic<size_t> next{0};
+  size_t written = 0;
+  std::mutex mu;
+  std::condition_variable ready;
+  std::condition_variable drained;
+
+  void work();
+  void convert(chunk &c, ever::stream_formatter &fmt) const;
+};
+
+converter::converter(const options &opts, const char* data, size_t size):
+  opts(opts),
+  parser(opts.input) {
+  const char* end = data + size;
+  while (data < end) {
+    const char* last = data + std::min(opts.chunk, size_t(end - data));
+    if (last < end) {
+      const char* nl = static_cast<const char*>(std::memchr(last, '\n', end - last));
+      last = nl ? nl + 1 : end;
+    }
+    chunks.push_back(chunk{data, last, {}, false});
+    data = last;
+  }
+  window = opts.threads * 4;
+}
+
+void converter::convert(chunk &c, ever::stream_formatter &fmt) const {
+  c.out.reserve((c.last - c.first) + (c.last - c.first) / 4);
+  const char* ptr = c.first;
+  while (ptr < c.last) {
+    const char* eol = static_cast<const char*>(std::memchr(ptr, '\n', c.last - ptr));
+    const char* next = eol ? eol + 1 : c.last;
+    const char* end = eol ? eol : c.last;
+    if (end > ptr && end[-1] == '\r') {
+      end--;
+    }
+
+    const char* beg = ptr;
+    const char* stop = end;
+    if (opts.delimiter) {
+      for (int i = 1; i < opts.column && beg < end; i++) {
+        const char* d = static_cast<const char*>(std::memchr(beg, opts.delimiter, end - beg));
+        beg = d ? d + 1 : end;
+      }
+      const char* d = static_cast<const char*>(std::memchr(beg, opts.delimiter, end - beg));
+      stop = d ? d : end;
+    }
+
+    auto res = parser.try_parse(beg, stop);
+    if (!res) {
+      c.out.append(ptr, next - ptr);
+    } else {
+      c.out.append(ptr, beg - ptr);
+      c.out.append(fmt.format(res.value));
+      c.out.append(stop, next - stop);
+    }
+    ptr = next;
+  }
+}
+
+void converter::work() {
+  ever::stream_formatter fmt(opts.output);
+  for (;;) {
+    size_t i = next.fetch_add(1);
+    if (i >= chunks.size()) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      drained.wait(lock, [&] { return i < written + window; });
+    }
+    convert(chunks[i], fmt);
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      chunks[i].done = true;
+    }
+    ready.notify_all();
+  }
+}
+
+static bool write_all(int fd, const char* buf, size_t len) {
+  while (len) {
+    ssize_t n = ::write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+int converter::run(int fd) {
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < opts.threads; i++) {
+    workers.emplace_back(&converter::work, this);
+  }
+  int rc = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      ready.wait(lock, [&] { return chunks[i].done; });
+    }
+    if (!rc && !write_all(fd, chunks[i].out.data(), chunks[i].out.size())) {
+      std::cerr << "ever-convert: write: " << std::strerror(errno) << std::endl;
+      rc = 1;
+    }
+    std::string().swap(chunks[i].out);
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      written = i + 1;
+    }
+    drained.notify_all();
+  }
+  for (auto& w: workers) {
+    w.join();
+  }
+  return rc;
+}
+
+// read_int reads a whole decimal number in [lo, hi].
+static bool read_int(const char* str, long lo, long hi, long &v) {
+  char* end;
+  errno = 0;
+  v = std::strtol(str, &end, 10);
+  return end != str && !*end && !errno && v >= lo && v <= hi;
+}
+
+// max_threads bounds -j, far above the cores of any machine.
+static const long max_threads = 1024;
+
+static void usage() {
+  std::cerr << "usage: ever-convert [-j threads] [-d delimiter] [-c column] -i input -o output file [outfile]" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  options opts;
+  long v;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:d:c:i:o:")) != -1) {
+    switch (opt) {
+      case 'j':
+      if (!read_int(optarg, 1, max_threads, v)) {
+        usage();
+        return 2;
+      }
+      opts.threads = v;
+      break;
+      case 'd':
+      opts.delimiter = std::strcmp(optarg, "\\t") ? optarg[0] : '\t';
+      break;
+      case 'c':
+      if (!read_int(optarg, 1, INT_MAX, v)) {
+        usage();
+        return 2;
+      }
+      opts.column = v;
+      break;
+      case 'i':
+      opts.input = optarg;
+      break;
+      case 'o':
+      opts.output = optarg;
+      break;
+      default:
+      usage();
+      return 2;
+    }
+  }
+  if (opts.input.empty() || opts.output.empty() || optind >= argc) {
+    usage();
+    return 2;
+  }
+  if (!opts.threads) {
+    opts.threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  int in = ::open(argv[optind], O_RDONLY);
+  if (in < 0) {
+    std::cerr << "ever-convert: " << argv[optind] << ": " << std::strerror(errno) << std::endl;
+    return 1;
+  }
+  struct stat st;
+  if (fstat(in, &st) < 0) {
+    std::cerr << "ever-convert: " << argv[optind] << ": " << std::strerror(errno) << std::endl;
+    return 1;
+  }
+  size_t size = st.st_size;
+  const char* data = nullptr;
+  if (size) {
+    void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in, 0);
+    if (ptr == MAP_FAILED) {
+      std::cerr << "ever-convert: mmap: " << std::strerror(errno) << std::endl;
+      return 1;
+    }
+    madvise(ptr, size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(ptr);
+  }
+
+  int out = STDOUT_FILENO;
+  if (optind + 1 < argc) {
+    out = ::open(argv[optind+1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+      std::cerr << "ever-convert: " << argv[optind+1] << ": " << std::strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+
+  int rc;
+  try {
+    converter conv(opts, data, size);
+    rc = conv.run(out);
+  } catch (const ever::parse_error &e) {
+    std::cerr << "ever-convert: " << opts.input << ": " << e.what() << std::endl;
+    rc = 2;
+  }
+  if (data) {
+    munmap(const_cast<char*>(data), size);
+  }
+  ::close(in);
+  if (out != STDOUT_FILENO && ::close(out) < 0) {
+    std::cerr << "ever-convert: " << std::strerror(errno) << std::endl;
+    rc = 1;
+  }
+  return rc;
+}
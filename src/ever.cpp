@@ -1,714 +1,2764 @@
-#include <sstream>
+#include <cstring>
+#include <ctime>
 #include <chrono>
-#include <iomanip>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <queue>
+#include <climits>
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <sstream>
+#include <fstream>
 #include "ever.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EVER_X86
+#include <immintrin.h>
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
 namespace ever {
 
-  const unsigned days400Years = (365 * 400) + 97;
-  const unsigned days100Years = (365 * 100) + 24;
-  const unsigned days4Years = (365 * 4) + 1;
-  const unsigned daysYears = 365;
+  // %Y: year (4 digits optionally preceded by -)
+  // %M: month
+  // %D: day
+  // %j: year day
+  // %h: hour
+  // %m: minute
+  // %s: second
+  // %f: millisecond
+  // %%: literal %
+  instant instant::parse(std::string_view pattern, std::string_view str) {
+    auto res = try_parse(pattern, str);
+    if (!res) {
+      throw parse_error(res.error, res.offset);
+    }
+    return res.value;
+  }
+
+  // try_parse walks the pattern along with the input instead of compiling it
+  // first so that it never allocates. Errors in the pattern are reported at
+  // the offset in the input where the faulty specifier is met.
+  parse_result instant::try_parse(std::string_view pattern, std::string_view str) noexcept {
+    parse_result res;
+    parser::compile_state cs;
+    parser::fields f;
+    parser::op o;
+
+    auto first = str.data();
+    auto last = first + str.size();
+    auto in = first;
+    size_t pos = 0;
+    while (pos < pattern.size()) {
+      res.error = parser::next_op(pattern, pos, cs, o);
+      if (res.error == parse_errc::none) {
+        res.error = parser::apply_op(o, pattern.data(), first, in, last, f);
+      }
+      if (res.error != parse_errc::none) {
+        res.offset = in - first;
+        return res;
+      }
+    }
+    if (in != last) {
+      res.error = parse_errc::trailing_input;
+      res.offset = in - first;
+      return res;
+    }
+    res.error = parser::make_instant(f, res.value);
+    if (res.error != parse_errc::none) {
+      res.offset = f.day_offset;
+    }
+    return res;
+  }
+
+  // iso_patterns are the layouts accepted by try_parse_iso written as
+  // patterns for the general parser.
+  static const std::string_view iso_patterns[] = {
+    "%Y-%M-%D %h:%m:%s",
+    "%Y-%M-%D %h:%m:%sZ",
+    "%Y-%M-%D %h:%m:%s.%f",
+    "%Y-%M-%D %h:%m:%s.%fZ",
+    "%Y-%M-%DT%h:%m:%s",
+    "%Y-%M-%DT%h:%m:%sZ",
+    "%Y-%M-%DT%h:%m:%s.%f",
+    "%Y-%M-%DT%h:%m:%s.%fZ",
+  };
+
+  // iso_head checks and converts the first 16 characters of a fixed layout
+  // timestamp (YYYY-MM-DDThh:mm) except the separator between the date and
+  // the time. v receives the year, month, day, hour and minute.
+  static bool iso_head_scalar(const char* str, int* v) {
+    static const char layout[] = "0000-00-00T00:00";
+    int n = 0;
+    int i = 0;
+    for (; i < 16; i++) {
+      if (layout[i] == '0') {
+        unsigned c = str[i] - '0';
+        if (c > 9) {
+          return false;
+        }
+        v[n] = v[n] * 10 + c;
+        continue;
+      }
+      if (i != 10 && str[i] != layout[i]) {
+        return false;
+      }
+      n++;
+    }
+    return true;
+  }
+
+#ifdef EVER_X86
+  __attribute__((target("ssse3")))
+  static bool iso_head_ssse3(const char* str, int* v) {
+    const __m128i seps = _mm_setr_epi8(0, 0, 0, 0, '-', 0, 0, '-', 0, 0, 0, 0, 0, ':', 0, 0);
+    const __m128i mask = _mm_setr_epi8(0, 0, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0);
+
+    // every byte should be a digit except for the separators
+    __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str));
+    __m128i digits = _mm_sub_epi8(in, _mm_set1_epi8('0'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(9)), digits);
+    __m128i is_sep = _mm_or_si128(_mm_cmpeq_epi8(in, seps), _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0));
+    __m128i ok = _mm_or_si128(_mm_andnot_si128(mask, is_digit), _mm_and_si128(mask, is_sep));
+    if (_mm_movemask_epi8(ok) != 0xFFFF) {
+      return false;
+    }
+
+    // gather the digits by pair and combine them: YY YY MM DD hh mm
+    const __m128i pairs = _mm_setr_epi8(0, 1, 2, 3, 5, 6, 8, 9, 11, 12, 14, 15, -1, -1, -1, -1);
+    const __m128i tens = _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 10, 1, 0, 0, 0, 0);
+    __m128i values = _mm_maddubs_epi16(_mm_shuffle_epi8(digits, pairs), tens);
+    __m128i year = _mm_madd_epi16(values, _mm_setr_epi16(100, 1, 0, 0, 0, 0, 0, 0));
+
+    v[0] = _mm_cvtsi128_si32(year);
+    v[1] = _mm_extract_epi16(values, 2);
+    v[2] = _mm_extract_epi16(values, 3);
+    v[3] = _mm_extract_epi16(values, 4);
+    v[4] = _mm_extract_epi16(values, 5);
+    return true;
+  }
+#endif
+
+  using iso_head_func = bool (*)(const char*, int*);
+
+  static iso_head_func select_iso_head() {
+#ifdef EVER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+      return iso_head_ssse3;
+    }
+#endif
+    return iso_head_scalar;
+  }
+
+  instant instant::parse_iso(std::string_view str) {
+    auto res = try_parse_iso(str);
+    if (!res) {
+      throw parse_error(res.error, res.offset);
+    }
+    return res.value;
+  }
+
+  // try_parse_iso parses timestamps written as YYYY-MM-DDThh:mm:ss or
+  // YYYY-MM-DD hh:mm:ss optionally followed by .fff and/or Z. The first 16
+  // characters are checked and converted at once with SSSE3 when available.
+  // Anything else (including errors) is handed to the general parser with
+  // the pattern of the layout that is the closest to str.
+  parse_result instant::try_parse_iso(std::string_view str) noexcept {
+    static const iso_head_func iso_head = select_iso_head();
+
+    size_t len = str.size();
+    size_t sign = len && str[0] == '-';
+    bool zulu = len && str.back() == 'Z';
+    bool frac = !sign && len - zulu == 23;
+    if (!sign && (len - zulu == 19 || frac)) {
+      auto ptr = str.data();
+      int v[5] = {0};
+      bool ok = (ptr[10] == 'T' || ptr[10] == ' ') && iso_head(ptr, v);
+      ok = ok && ptr[16] == ':' && (!frac || ptr[19] == '.');
+
+      unsigned tail[5];
+      unsigned bad = 0;
+      for (int i = 0; ok && i < (frac ? 5 : 2); i++) {
+        tail[i] = ptr[i < 2 ? 17+i : 18+i] - '0';
+        bad |= tail[i] > 9;
+      }
+      ok = ok && !bad;
+      if (ok) {
+        int sec = tail[0] * 10 + tail[1];
+        int ms = frac ? tail[2] * 100 + tail[3] * 10 + tail[4] : 0;
+        int leap = v[1] == 2 && is_leap(v[0]);
+        bool valid = v[1] >= 1 && v[1] <= 12 && v[2] >= 1 && v[2] <= month_days[v[1]] + leap;
+        valid = valid && v[3] <= 23 && v[4] <= 59 && sec <= 59;
+        if (valid) {
+          long long days = days_from_civil(v[0], v[1], v[2]);
+          long long secs = days * secondsPerDay + v[3] * secondsPerHour + v[4] * secondsPerMin + sec;
+          parse_result res;
+          res.value.timestamp = secs * millis + ms;
+          return res;
+        }
+      }
+    }
+    size_t i = (len > 10+sign && str[10+sign] == 'T' ? 4 : 0) + (len > 19+sign && str[19+sign] == '.' ? 2 : 0) + zulu;
+    return try_parse(iso_patterns[i], str);
+  }
+
+  instant instant::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return instant(ts.tv_sec, ts.tv_nsec / 1000000);
+  }
+
+  instant instant::now_coarse() {
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return instant(ts.tv_sec, ts.tv_nsec / 1000000);
+#else
+    return now();
+#endif
+  }
+
+  static long long clock_nanos(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+
+  static unsigned long long read_cycles() {
+#ifdef EVER_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+  static bool invariant_tsc() {
+#ifdef EVER_X86
+    unsigned a, b, c, d;
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d)) {
+      return false;
+    }
+    return d & (1u << 8);
+#else
+    return false;
+#endif
+  }
+
+  // tsc_warmup is how long the first calibration spins, tsc_period how often
+  // the clock is calibrated again and tsc_drift the largest change of rate
+  // between two calibrations before the TSC is considered unstable.
+  static constexpr long long tsc_warmup = 2000000;
+  static constexpr long long tsc_period = 1000000000;
+  static constexpr double tsc_drift = 0.01;
+
+  enum class tsc_mode {unknown, tsc, syscall};
+
+  // the calibration is published with a sequence lock: writers make tsc_seq
+  // odd while they update it and readers retry when it changed.
+  static std::atomic<tsc_mode> tsc_state{tsc_mode::unknown};
+  static std::atomic<unsigned> tsc_seq{0};
+  static std::atomic<unsigned long long> tsc_cycles{0};
+  static std::atomic<long long> tsc_real{0};
+  static std::atomic<long long> tsc_mono{0};
+  static std::atomic<double> tsc_scale{0};
+  static std::atomic_flag tsc_busy = ATOMIC_FLAG_INIT;
+  static std::once_flag tsc_once;
+
+  static void tsc_publish(unsigned long long cycles, long long real, long long mono, double scale) {
+    unsigned seq = tsc_seq.load(std::memory_order_relaxed);
+    tsc_seq.store(seq+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    tsc_cycles.store(cycles, std::memory_order_relaxed);
+    tsc_real.store(real, std::memory_order_relaxed);
+    tsc_mono.store(mono, std::memory_order_relaxed);
+    tsc_scale.store(scale, std::memory_order_relaxed);
+    tsc_seq.store(seq+2, std::memory_order_release);
+  }
+
+  static void tsc_calibrate() {
+    if (!invariant_tsc()) {
+      tsc_state.store(tsc_mode::syscall);
+      return;
+    }
+    long long mono0 = clock_nanos(CLOCK_MONOTONIC);
+    unsigned long long cycles0 = read_cycles();
+    long long mono1;
+    do {
+      mono1 = clock_nanos(CLOCK_MONOTONIC);
+    } while (mono1 - mono0 < tsc_warmup);
+    unsigned long long cycles1 = read_cycles();
+    long long real = clock_nanos(CLOCK_REALTIME);
+    if (cycles1 <= cycles0) {
+      tsc_state.store(tsc_mode::syscall);
+      return;
+    }
+    tsc_publish(cycles1, real, mono1, double(mono1 - mono0) / double(cycles1 - cycles0));
+    tsc_state.store(tsc_mode::tsc);
+  }
+
+  // tsc_recalibrate measures the rate of the TSC since the last calibration
+  // and anchors it again on CLOCK_REALTIME. Only one thread does the work,
+  // the others keep on using the current calibration.
+  static void tsc_recalibrate(unsigned long long base, long long mono0, double scale) {
+    if (tsc_busy.test_and_set(std::memory_order_acquire)) {
+      return;
+    }
+    if (tsc_cycles.load(std::memory_order_relaxed) == base) {
+      long long mono = clock_nanos(CLOCK_MONOTONIC);
+      unsigned long long cycles = read_cycles();
+      long long real = clock_nanos(CLOCK_REALTIME);
+      double rate = cycles > base ? double(mono - mono0) / double(cycles - base) : 0;
+      if (std::abs(rate - scale) > scale * tsc_drift) {
+        tsc_state.store(tsc_mode::syscall);
+      } else {
+        tsc_publish(cycles, real, mono, rate);
+      }
+    }
+    tsc_busy.clear(std::memory_order_release);
+  }
+
+  long long fast_clock::now_nanos() {
+    if (tsc_state.load(std::memory_order_relaxed) == tsc_mode::unknown) {
+      std::call_once(tsc_once, tsc_calibrate);
+    }
+    if (tsc_state.load(std::memory_order_relaxed) != tsc_mode::tsc) {
+      return clock_nanos(CLOCK_REALTIME);
+    }
+    unsigned seq;
+    unsigned long long base;
+    long long real, mono;
+    double scale;
+    do {
+      seq = tsc_seq.load(std::memory_order_acquire);
+      base = tsc_cycles.load(std::memory_order_relaxed);
+      real = tsc_real.load(std::memory_order_relaxed);
+      mono = tsc_mono.load(std::memory_order_relaxed);
+      scale = tsc_scale.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) || seq != tsc_seq.load(std::memory_order_relaxed));
+
+    unsigned long long cycles = read_cycles();
+    if (cycles <= base) {
+      return real;
+    }
+    long long elapsed = (long long)(double(cycles - base) * scale);
+    if (elapsed >= tsc_period) {
+      tsc_recalibrate(base, mono, scale);
+    }
+    return real + elapsed;
+  }
+
+  instant fast_clock::now() {
+    long long nanos = now_nanos();
+    return instant(nanos / 1000000000, (nanos % 1000000000) / 1000000);
+  }
+
+  bool fast_clock::uses_tsc() {
+    now_nanos();
+    return tsc_state.load(std::memory_order_relaxed) == tsc_mode::tsc;
+  }
+
+  // tai_utc_gps is the difference between TAI and UTC at the GPS epoch.
+  const int tai_utc_gps = 19;
+  // seconds between 1900-01-01 (NTP epoch) and 1970-01-01
+  const long long ntp_epoch = 2208988800LL;
+
+  static std::atomic<const leap_table*> current_table{nullptr};
+  static std::mutex install_mu;
+  static std::vector<std::unique_ptr<leap_table>> installed_tables;
+
+  const leap_table& leap_table::current() {
+    const leap_table* t = current_table.load(std::memory_order_acquire);
+    if (t) {
+      return *t;
+    }
+    static const leap_table table = builtin();
+    return table;
+  }
+
+  void leap_table::install(leap_table t) {
+    std::lock_guard<std::mutex> lock(install_mu);
+    installed_tables.push_back(std::make_unique<leap_table>(std::move(t)));
+    current_table.store(installed_tables.back().get(), std::memory_order_release);
+  }
+
+  leap_table leap_table::builtin() {
+    leap_table t;
+    int offset = 0;
+    for (auto s: instant::leap_seconds) {
+      t.push(s, ++offset);
+    }
+    return t;
+  }
+
+  leap_table leap_table::parse(std::istream &in) {
+    static const char* months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    auto month_of = [](const std::string &str) {
+      for (int i = 0; i < 12; i++) {
+        if (str == months[i]) {
+          return i + 1;
+        }
+      }
+      throw parse_error("unknown month in leap second list: " + str);
+    };
+
+    leap_table t;
+    int tai_utc = 10;
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream is(line);
+      std::string word;
+      if (line.compare(0, 2, "#@") == 0) {
+        long long ntp;
+        if (is >> word >> ntp) {
+          t.expiry = ntp - ntp_epoch;
+        }
+        continue;
+      }
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+      if (line[0] >= '0' && line[0] <= '9') {
+        long long ntp;
+        if (!(is >> ntp >> tai_utc)) {
+          throw parse_error("invalid leap second entry: " + line);
+        }
+        if (tai_utc > tai_utc_gps) {
+          t.push(ntp - ntp_epoch, tai_utc - tai_utc_gps);
+        }
+        continue;
+      }
+      int year, day, h, m, sec;
+      std::string mon, hms, corr;
+      char c1, c2;
+      is >> word;
+      if (word == "Leap" && is >> year >> mon >> day >> hms >> corr) {
+        std::istringstream(hms) >> h >> c1 >> m >> c2 >> sec;
+        // the instant right after the second inserted (23:59:60) or removed
+        // (23:59:59) is the start of the next day in both cases.
+        long long utc = days_from_civil(year, month_of(mon), day) * secondsPerDay;
+        utc += h * secondsPerHour + m * secondsPerMin + sec + (corr == "-");
+        tai_utc += corr == "-" ? -1 : 1;
+        if (tai_utc > tai_utc_gps) {
+          t.push(utc, tai_utc - tai_utc_gps);
+        }
+      } else if (word == "Expires" && is >> year >> mon >> day >> hms) {
+        std::istringstream(hms) >> h >> c1 >> m >> c2 >> sec;
+        t.expiry = days_from_civil(year, month_of(mon), day) * secondsPerDay + h * secondsPerHour + m * secondsPerMin + sec;
+      } else {
+        throw parse_error("invalid leap second entry: " + line);
+      }
+    }
+    return t;
+  }
+
+  leap_table leap_table::load(const std::string &file) {
+    std::ifstream in(file);
+    if (!in) {
+      throw parse_error("can not open leap second list: " + file);
+    }
+    return parse(in);
+  }
+
+  void leap_table::push(long long s, int offset) {
+    if (!utc.empty() && s <= utc.back()) {
+      throw parse_error("leap seconds are not sorted");
+    }
+    utc.push_back(s);
+    gps.push_back(s + offset);
+    offsets.push_back(offset);
+  }
+
+  size_t leap_table::size() const {
+    return utc.size();
+  }
+
+  long long leap_table::expires() const {
+    return expiry;
+  }
 
-  const unsigned secondsPerMin = 60;
-  const unsigned secondsPerHour = 60*60;
-  const unsigned secondsPerDay = 60*60*24;
-  const unsigned secondsPerWeek = secondsPerDay*7;
+  leap_table::bucket leap_table::utc_bucket(long long secs) const {
+    bucket b;
+    size_t n = utc.size();
+    size_t i = n && secs >= utc.back() ? n : std::upper_bound(utc.begin(), utc.end(), secs) - utc.begin();
+    b.count = i ? offsets[i-1] : 0;
+    b.lo = i ? utc[i-1] : LLONG_MIN;
+    b.hi = i < n ? utc[i] : LLONG_MAX;
+    return b;
+  }
 
-  bool is_leap(int year) {
-    return year % 400 == 0 || (year % 4 == 0 && year % 100 != 0);
+  // gps_bucket is the same as utc_bucket for secs in the GPS scale where
+  // each leap second is shifted by the offset it introduces.
+  leap_table::bucket leap_table::gps_bucket(long long secs) const {
+    bucket b;
+    size_t n = gps.size();
+    size_t i = n && secs >= gps.back() ? n : std::upper_bound(gps.begin(), gps.end(), secs) - gps.begin();
+    b.count = i ? offsets[i-1] : 0;
+    b.lo = i ? gps[i-1] : LLONG_MIN;
+    b.hi = i < n ? gps[i] : LLONG_MAX;
+    return b;
   }
 
-  instant instant::parse(std::string pattern, std::string str) {
+  instant instant::to_unix() const {
+    if (zero == epoch_t::unix) {
+      return *this;
+    }
+    instant i = *this;
+    if (zero == epoch_t::tai) {
+      i.timestamp -= tai_offset * millis;
+    }
+    i.timestamp -= leap_table::current().gps_bucket(floor_div(i.timestamp, millis)).count * millis;
+    i.zero = epoch_t::unix;
+    return i;
+  }
+
+  instant instant::to_gps() const {
+    instant i = *this;
+    if (zero == epoch_t::gps) {
+      return i;
+    }
+    if (zero == epoch_t::tai) {
+      i.timestamp -= tai_offset * millis;
+    } else {
+      i.timestamp += leap_table::current().utc_bucket(floor_div(timestamp, millis)).count * millis;
+    }
+    i.zero = epoch_t::gps;
+    return i;
+  }
+
+  instant instant::to_tai() const {
+    if (zero == epoch_t::tai) {
+      return *this;
+    }
+    instant i = to_gps();
+    i.timestamp += tai_offset * millis;
+    i.zero = epoch_t::tai;
+    return i;
+  }
+
+  long long instant::diff_leap(const instant &w) const {
+    return to_gps().diff(w.to_gps());
+  }
+
+  void to_unix(const instant* first, size_t n, instant* out) {
+    const leap_table &t = leap_table::current();
+    leap_table::bucket b;
+    for (size_t i = 0; i < n; i++) {
+      const instant &w = first[i];
+      if (w.zero != instant::epoch_t::gps) {
+        out[i] = w.to_unix();
+        continue;
+      }
+      long long secs = floor_div(w.timestamp, instant::millis);
+      if (!b.contains(secs)) {
+        b = t.gps_bucket(secs);
+      }
+      out[i] = w;
+      out[i].timestamp -= b.count * instant::millis;
+      out[i].zero = instant::epoch_t::unix;
+    }
+  }
+
+  void to_gps(const instant* first, size_t n, instant* out) {
+    const leap_table &t = leap_table::current();
+    leap_table::bucket b;
+    for (size_t i = 0; i < n; i++) {
+      const instant &w = first[i];
+      if (w.zero != instant::epoch_t::unix) {
+        out[i] = w.to_gps();
+        continue;
+      }
+      long long secs = floor_div(w.timestamp, instant::millis);
+      if (!b.contains(secs)) {
+        b = t.utc_bucket(secs);
+      }
+      out[i] = w;
+      out[i].timestamp += b.count * instant::millis;
+      out[i].zero = instant::epoch_t::gps;
+    }
+  }
+
+  void to_tai(const instant* first, size_t n, instant* out) {
+    to_gps(first, n, out);
+    for (size_t i = 0; i < n; i++) {
+      out[i] = out[i].to_tai();
+    }
+  }
+
+  // %S: timestamp
+  // %Y: year
+  // %M: month
+  // %D: day
+  // %j: year day
+  // %h: hour
+  // %m: minute
+  // %s: second
+  // %f: millisecond
+  // %%: literal %
+  std::string instant::format(std::string pattern) const {
+    return formatter(pattern).format(*this);
+  }
+
+  std::string instant::to_string() const {
+    return format();
+  }
+
+  // write_number writes v into out padded with 0 up to width characters, the
+  // same way a stream does with std::setw and std::setfill('0'): the padding
+  // goes before the sign of negative values. out should have room for at
+  // least 21 characters.
+  static size_t write_number(char* out, long long v, int width) {
+    static const long long limits[] = {1, 10, 100, 1000, 10000};
+    if (v >= 0 && width > 0 && width < 5 && v < limits[width]) {
+      for (int i = width-1; i >= 0; i--) {
+        out[i] = '0' + (v % 10);
+        v /= 10;
+      }
+      return width;
+    }
+    char tmp[24];
+    char* end = tmp + sizeof(tmp);
+    char* ptr = end;
+    unsigned long long u = v < 0 ? -static_cast<unsigned long long>(v) : v;
+    do {
+      *--ptr = '0' + (u % 10);
+      u /= 10;
+    } while (u);
+    if (v < 0) {
+      *--ptr = '-';
+    }
+    size_t n = end - ptr;
+    size_t pad = static_cast<size_t>(width) > n ? width - n : 0;
+    std::memset(out, '0', pad);
+    std::memcpy(out+pad, ptr, n);
+    return pad + n;
+  }
+
+  formatter::formatter(std::string pattern) {
     auto it = pattern.begin();
-    auto in = str.begin();
+    while (it != pattern.end()) {
+      if (*it != '%') {
+        auto beg = it;
+        while (it != pattern.end() && *it != '%') {
+          it = std::next(it);
+        }
+        push_literal(&*beg, std::distance(beg, it));
+        continue;
+      }
+      it = std::next(it);
+      if (it == pattern.end()) {
+        push_literal("?", 1);
+        break;
+      }
+      switch (*it) {
+        case '%':
+        push_literal("%", 1);
+        break;
+        case 'S':
+        push_field(field_t::unix, 0);
+        break;
+        case 'Y':
+        push_field(field_t::year, 4);
+        break;
+        case 'M':
+        push_field(field_t::month, 2);
+        break;
+        case 'D':
+        push_field(field_t::day, 2);
+        break;
+        case 'j':
+        push_field(field_t::year_day, 3);
+        break;
+        case 'h':
+        push_field(field_t::hour, 2);
+        break;
+        case 'm':
+        push_field(field_t::minute, 2);
+        break;
+        case 's':
+        push_field(field_t::second, 2);
+        break;
+        case 'f':
+        push_field(field_t::millis, 3);
+        break;
+        default:
+        push_literal("?", 1);
+        break;
+      }
+      it = std::next(it);
+    }
+  }
+
+  void formatter::push_literal(const char* str, size_t len) {
+    if (!ops.empty() && ops.back().field == field_t::literal) {
+      literals.append(str, len);
+      ops.back().length += len;
+      return;
+    }
+    ops.push_back(op{field_t::literal, 0, literals.size(), len});
+    literals.append(str, len);
+  }
+
+  void formatter::push_field(field_t field, int width) {
+    switch (field) {
+      case field_t::year:
+      case field_t::month:
+      case field_t::day:
+      case field_t::year_day:
+      with_date = true;
+      break;
+      case field_t::hour:
+      case field_t::minute:
+      case field_t::second:
+      with_time = true;
+      break;
+      default:
+      break;
+    }
+    ops.push_back(op{field, width, 0, 0});
+  }
+
+  size_t formatter::format_to(char* buf, size_t len, const instant &w) const {
+    return render(buf, len, w, nullptr);
+  }
+
+  size_t formatter::render(char* buf, size_t len, const instant &w, size_t* offsets) const {
+    civil c{};
+    if (with_date) {
+      c = w.fields();
+    } else if (with_time) {
+      std::tie(c.hour, c.minute, c.second) = w.split_time();
+    }
+
+    char tmp[24];
+    size_t n = 0;
+    for (size_t i = 0; i < ops.size(); i++) {
+      const auto& o = ops[i];
+      size_t avail = n < len ? len - n : 0;
+      if (offsets) {
+        offsets[i] = n;
+      }
+      if (o.field == field_t::literal) {
+        if (avail) {
+          std::memcpy(buf+n, literals.data()+o.offset, std::min(o.length, avail));
+        }
+        n += o.length;
+        continue;
+      }
+      long long v = 0;
+      switch (o.field) {
+        case field_t::unix:
+        v = w.get_seconds();
+        break;
+        case field_t::year:
+        v = c.year;
+        break;
+        case field_t::month:
+        v = c.month;
+        break;
+        case field_t::day:
+        v = c.day;
+        break;
+        case field_t::year_day:
+        v = c.year_day;
+        break;
+        case field_t::hour:
+        v = c.hour;
+        break;
+        case field_t::minute:
+        v = c.minute;
+        break;
+        case field_t::second:
+        v = c.second;
+        break;
+        case field_t::millis:
+        v = w.get_millis();
+        break;
+        default:
+        break;
+      }
+      if (avail >= sizeof(tmp)) {
+        n += write_number(buf+n, v, o.width);
+      } else {
+        size_t z = write_number(tmp, v, o.width);
+        if (avail) {
+          std::memcpy(buf+n, tmp, std::min(z, avail));
+        }
+        n += z;
+      }
+    }
+    return n;
+  }
+
+  std::string formatter::format(const instant &w) const {
+    char buf[64];
+    size_t n = format_to(buf, sizeof(buf), w);
+    if (n <= sizeof(buf)) {
+      return std::string(buf, n);
+    }
+    std::string str(n, 0);
+    format_to(&str[0], n, w);
+    return str;
+  }
+
+  stream_formatter::stream_formatter(std::string pattern):
+    fmt(pattern),
+    offsets(fmt.ops.size()),
+    with_unix(false) {
+    for (const auto& o: fmt.ops) {
+      with_unix = with_unix || o.field == formatter::field_t::unix;
+    }
+    reset();
+  }
+
+  void stream_formatter::reset() {
+    day = LLONG_MIN;
+    second = LLONG_MIN;
+    millis = -1;
+  }
+
+  void stream_formatter::render(const instant &w) {
+    text.resize(std::max(text.capacity(), size_t(64)));
+    size_t n = fmt.render(&text[0], text.size(), w, offsets.data());
+    if (n > text.size()) {
+      text.resize(n);
+      fmt.render(&text[0], n, w, offsets.data());
+    }
+    text.resize(n);
+  }
+
+  std::string_view stream_formatter::format(const instant &w) {
+    long long sec = w.get_seconds();
+    int ms = w.get_millis();
+    long long d = floor_div(sec, secondsPerDay);
+    if (d != day || (with_unix && sec != second)) {
+      render(w);
+      day = d;
+      second = sec;
+      millis = ms;
+      return text;
+    }
+    if (sec == second && ms == millis) {
+      return text;
+    }
+    // the fields of the time of day have a fixed width, so they can be
+    // written again in place.
+    long long tod = sec - d * secondsPerDay;
+    long long last = second - d * secondsPerDay;
+    for (size_t i = 0; i < fmt.ops.size(); i++) {
+      const auto& o = fmt.ops[i];
+      long long v, was;
+      switch (o.field) {
+        case formatter::field_t::hour:
+        v = tod / secondsPerHour;
+        was = last / secondsPerHour;
+        break;
+        case formatter::field_t::minute:
+        v = (tod / secondsPerMin) % 60;
+        was = (last / secondsPerMin) % 60;
+        break;
+        case formatter::field_t::second:
+        v = tod % 60;
+        was = last % 60;
+        break;
+        case formatter::field_t::millis:
+        v = ms;
+        was = millis;
+        break;
+        default:
+        continue;
+      }
+      if (v != was) {
+        write_number(&text[offsets[i]], v, o.width);
+      }
+    }
+    second = sec;
+    millis = ms;
+    return text;
+  }
+
+  time_cache::time_cache(std::string pattern, bool coarse):
+    fmt(pattern),
+    coarse(coarse) {}
+
+  time_cache& time_cache::local() {
+    static thread_local time_cache cache;
+    return cache;
+  }
+
+  std::string_view time_cache::stamp() {
+    return stamp(coarse ? instant::now_coarse() : instant::now());
+  }
+
+  std::string_view time_cache::stamp(const instant &w) {
+    return fmt.format(w);
+  }
+
+  const char* describe(parse_errc err) {
+    switch (err) {
+      case parse_errc::none:
+      return "no error";
+      case parse_errc::unexpected_character:
+      return "unexpected character";
+      case parse_errc::unexpected_end:
+      return "unexpected end of input";
+      case parse_errc::trailing_input:
+      return "fail to parse input string";
+      case parse_errc::unknown_specifier:
+      return "unknown specifier";
+      case parse_errc::year_day_conflict:
+      return "day of year can not be set with day and/or month";
+      case parse_errc::invalid_month:
+      return "month should be between 1 and 12";
+      case parse_errc::invalid_day:
+      return "day of month should be between 1 and 31";
+      case parse_errc::invalid_year_day:
+      return "day of year should be between 1 and 366";
+      case parse_errc::invalid_hour:
+      return "hour should be between 0 and 23";
+      case parse_errc::invalid_minute:
+      return "minute should be between 0 and 59";
+      case parse_errc::invalid_second:
+      return "second should be between 0 and 59";
+      case parse_errc::invalid_month_day:
+      return "invalid day for given month";
+    }
+    return "unexpected error";
+  }
+
+  parser::parser(std::string_view pattern): pattern(pattern) {
+    compile_state cs;
+    size_t pos = 0;
+    while (pos < pattern.size()) {
+      op o;
+      auto err = next_op(pattern, pos, cs, o);
+      if (err != parse_errc::none) {
+        throw parse_error(err, pos);
+      }
+      ops.push_back(o);
+    }
+    for (auto p: iso_patterns) {
+      if (pattern == p) {
+        iso_length = 19 + (pattern.find(".%f") != std::string_view::npos ? 4 : 0) + (pattern.back() == 'Z');
+        break;
+      }
+    }
+  }
+
+  // next_op reads the literal or the specifier starting at pos and leaves pos
+  // after it. Literals are given as an offset and a length in the pattern.
+  parse_errc parser::next_op(std::string_view pattern, size_t &pos, compile_state &cs, op &o) noexcept {
+    if (pattern[pos] != '%') {
+      size_t end = pattern.find('%', pos);
+      if (end == std::string_view::npos) {
+        end = pattern.size();
+      }
+      o = op{field_t::literal, 0, pos, end - pos};
+      pos = end;
+      return parse_errc::none;
+    }
+    if (pos+1 >= pattern.size()) {
+      return parse_errc::unknown_specifier;
+    }
+    o = op{field_t::literal, 0, 0, 0};
+    switch (pattern[pos+1]) {
+      case '%':
+      o.offset = pos+1;
+      o.length = 1;
+      break;
+      case 'Y':
+      o.field = field_t::year;
+      o.width = 4;
+      break;
+      case 'M':
+      if (cs.with_yday) {
+        return parse_errc::year_day_conflict;
+      }
+      cs.with_mday = true;
+      o.field = field_t::month;
+      o.width = 2;
+      break;
+      case 'D':
+      if (cs.with_yday) {
+        return parse_errc::year_day_conflict;
+      }
+      cs.with_mday = true;
+      o.field = field_t::day;
+      o.width = 2;
+      break;
+      case 'j':
+      if (cs.with_mday) {
+        return parse_errc::year_day_conflict;
+      }
+      cs.with_yday = true;
+      o.field = field_t::year_day;
+      o.width = 3;
+      break;
+      case 'h':
+      o.field = field_t::hour;
+      o.width = 2;
+      break;
+      case 'm':
+      o.field = field_t::minute;
+      o.width = 2;
+      break;
+      case 's':
+      o.field = field_t::second;
+      o.width = 2;
+      break;
+      case 'f':
+      o.field = field_t::millis;
+      o.width = 3;
+      break;
+      default:
+      return parse_errc::unknown_specifier;
+    }
+    pos += 2;
+    return parse_errc::none;
+  }
+
+  parse_errc parser::apply_op(const op &o, const char* pattern, const char* first, const char* &in, const char* last, fields &f) noexcept {
+    if (o.field == field_t::literal) {
+      for (size_t i = 0; i < o.length; i++, in++) {
+        if (in == last) {
+          return parse_errc::unexpected_end;
+        }
+        if (*in != pattern[o.offset+i]) {
+          return parse_errc::unexpected_character;
+        }
+      }
+      return parse_errc::none;
+    }
     auto beg = in;
+    bool neg = o.field == field_t::year && in < last && *in == '-';
+    if (neg) {
+      in++;
+    }
+    int v = 0;
+    for (int i = 0; i < o.width; i++, in++) {
+      if (in == last) {
+        return parse_errc::unexpected_end;
+      }
+      unsigned c = *in - '0';
+      if (c > 9) {
+        return parse_errc::unexpected_character;
+      }
+      v = v * 10 + c;
+    }
+
+    auto err = set_field(o.field, neg ? -v : v, beg - first, f);
+    if (err != parse_errc::none) {
+      in = beg;
+    }
+    return err;
+  }
+
+  // set_field stores the value of a field read at offset and checks its
+  // range.
+  parse_errc parser::set_field(field_t field, int v, size_t offset, fields &f) noexcept {
+    auto err = parse_errc::none;
+    switch (field) {
+      case field_t::year:
+      f.year = v;
+      break;
+      case field_t::month:
+      f.month = v;
+      if (v < 1 || v > 12) {
+        err = parse_errc::invalid_month;
+      }
+      break;
+      case field_t::day:
+      f.day = v;
+      f.day_offset = offset;
+      if (v < 1 || v > 31) {
+        err = parse_errc::invalid_day;
+      }
+      break;
+      case field_t::year_day:
+      f.yday = v;
+      if (v < 1 || v > 366) {
+        err = parse_errc::invalid_year_day;
+      }
+      break;
+      case field_t::hour:
+      f.hour = v;
+      if (v > 23) {
+        err = parse_errc::invalid_hour;
+      }
+      break;
+      case field_t::minute:
+      f.minute = v;
+      if (v > 59) {
+        err = parse_errc::invalid_minute;
+      }
+      break;
+      case field_t::second:
+      f.second = v;
+      if (v > 59) {
+        err = parse_errc::invalid_second;
+      }
+      break;
+      case field_t::millis:
+      f.millis = v;
+      break;
+      default:
+      break;
+    }
+    return err;
+  }
+
+  parse_errc parser::make_instant(fields &f, instant &w) noexcept {
+    int leap = is_leap(f.year) ? 1 : 0;
+    if (f.yday > 0) {
+      f.month = 1;
+      while (f.month < 12 && f.yday > instant::year_days[f.month] + (f.month >= 2 ? leap : 0)) {
+        f.month++;
+      }
+      f.day = f.yday - instant::year_days[f.month-1] - (f.month > 2 ? leap : 0);
+    } else {
+      f.month = f.month < 0 ? 1 : f.month;
+      f.day = f.day < 0 ? 1 : f.day;
+      if (f.day > instant::month_days[f.month] + (f.month == 2 ? leap : 0)) {
+        return parse_errc::invalid_month_day;
+      }
+    }
+    w = instant(f.year, f.month, f.day, f.hour, f.minute, f.second);
+    w.timestamp += f.millis;
+    return parse_errc::none;
+  }
+
+  instant parser::parse(std::string_view str) const {
+    return parse(str.data(), str.data() + str.size());
+  }
 
-    int year = 0;
-    int yday = -1;
-    int month = -1;
-    int day = -1;
-    int hour = 0;
-    int minute = 0;
-    int second = 0;
+  instant parser::parse(const char* first, const char* last) const {
+    auto res = try_parse(first, last);
+    if (!res) {
+      throw parse_error(res.error, res.offset);
+    }
+    return res.value;
+  }
+
+  parse_result parser::try_parse(std::string_view str) const noexcept {
+    return try_parse(str.data(), str.data() + str.size());
+  }
+
+  parse_result parser::try_parse(const char* first, const char* last) const noexcept {
+    if (iso_length && static_cast<size_t>(last - first) == iso_length && first[10] == pattern[8]) {
+      auto res = instant::try_parse_iso(std::string_view(first, iso_length));
+      if (res) {
+        return res;
+      }
+    }
+    parse_result res;
+    fields f;
+    auto in = first;
+    for (const auto& o: ops) {
+      res.error = apply_op(o, pattern.data(), first, in, last, f);
+      if (res.error != parse_errc::none) {
+        res.offset = in - first;
+        return res;
+      }
+    }
+    if (in != last) {
+      res.error = parse_errc::trailing_input;
+      res.offset = in - first;
+      return res;
+    }
+    res.error = make_instant(f, res.value);
+    if (res.error != parse_errc::none) {
+      res.offset = f.day_offset;
+    }
+    return res;
+  }
 
-    auto atoi = [](std::string tmp) {
-      if (tmp == "00" || tmp == "000") {
-        return 0;
+  parse_result parser::try_parse_prefix(const char* first, const char* last) const noexcept {
+    parse_result res;
+    fields f;
+    auto in = first;
+    for (const auto& o: ops) {
+      res.error = apply_op(o, pattern.data(), first, in, last, f);
+      if (res.error != parse_errc::none) {
+        res.offset = in - first;
+        return res;
       }
-      tmp = tmp.substr(tmp.find_first_not_of('0'));
-      return std::stoi(tmp);
+    }
+    res.error = make_instant(f, res.value);
+    res.offset = res.error == parse_errc::none ? in - first : f.day_offset;
+    return res;
+  }
+
+  multi_parser::multi_parser(std::initializer_list<std::string_view> patterns) {
+    for (auto p: patterns) {
+      parsers.emplace_back(p);
+    }
+    compile();
+  }
+
+  multi_parser::multi_parser(const std::vector<std::string> &patterns) {
+    for (const auto& p: patterns) {
+      parsers.emplace_back(p);
+    }
+    compile();
+  }
+
+  // compile builds the automaton with the subset construction. Each pattern
+  // is first written as a list of items, one per character of the input: a
+  // literal, a digit or the optional sign of the year. A state of the
+  // automaton is the set of (pattern, item) pairs that can come next.
+  void multi_parser::compile() {
+    if (parsers.empty() || parsers.size() > 64) {
+      throw parse_error("multi_parser: between 1 and 64 patterns are expected");
+    }
+    enum class kind {literal, digit, sign};
+    struct item {
+      kind k;
+      char c;
+      uint16_t reg;
+      bool first;
+      bool year;
     };
 
-    while (*it) {
-      if (*it == '%') {
-        it = std::next(it);
-        if (*it == '%') {
-          if (*it != *in) {
-            throw parse_error("unexpected character");
+    // the registers are keyed by the items of the pattern up to the end of
+    // their field.
+    std::vector<std::vector<item>> items(parsers.size());
+    std::map<std::string, uint16_t> keys;
+    size_t num_registers = 0;
+    registers.resize(parsers.size());
+    for (size_t i = 0; i < parsers.size(); i++) {
+      const auto& p = parsers[i];
+      std::string key;
+      for (const auto& o: p.ops) {
+        if (o.field == parser::field_t::literal) {
+          for (size_t j = 0; j < o.length; j++) {
+            items[i].push_back(item{kind::literal, p.pattern[o.offset+j], 0, false, false});
+            key += 'l';
+            key += p.pattern[o.offset+j];
           }
-          in = std::next(in);
+          registers[i].push_back(0);
           continue;
         }
-        switch (*it) {
-          case 'Y':
-          beg = in;
-          if (*in == '-') {
-            in = std::next(in);
+        bool year = o.field == parser::field_t::year;
+        if (year) {
+          items[i].push_back(item{kind::sign, '-', 0, false, false});
+          key += 's';
+        }
+        key.append(o.width, 'd');
+        auto found = keys.find(key);
+        uint16_t reg;
+        if (found != keys.end()) {
+          reg = found->second;
+        } else {
+          reg = num_registers;
+          num_registers += year ? 2 : 1;
+          if (num_registers > max_registers) {
+            throw parse_error("multi_parser: too many fields");
           }
-          in = std::next(in, 4);
-          year = atoi(std::string(beg, in));
-          break;
-          case 'M':
-          if (yday > 0) {
-            throw parse_error("day of year already set while parsing month!");
+          keys.emplace(key, reg);
+        }
+        registers[i].push_back(reg);
+        for (int j = 0; j < o.width; j++) {
+          items[i].push_back(item{kind::digit, 0, reg, j == 0, year});
+        }
+      }
+    }
+
+    for (char c = '0'; c <= '9'; c++) {
+      classes[static_cast<unsigned char>(c)] = 1;
+    }
+    std::vector<char> reps(2, 0);
+    for (const auto& list: items) {
+      for (const auto& it: list) {
+        if (it.k != kind::digit && classes[static_cast<unsigned char>(it.c)] < 2) {
+          classes[static_cast<unsigned char>(it.c)] = reps.size();
+          reps.push_back(it.c);
+        }
+      }
+    }
+    for (char c = '0'; c <= '9'; c++) {
+      if (classes[static_cast<unsigned char>(c)] == 1) {
+        reps[1] = c;
+        break;
+      }
+    }
+    num_classes = reps.size();
+
+    using state = std::vector<std::pair<size_t, size_t>>;
+    auto close = [&](state &s) {
+      for (size_t i = 0; i < s.size(); i++) {
+        auto [p, pos] = s[i];
+        if (pos < items[p].size() && items[p][pos].k == kind::sign) {
+          s.emplace_back(p, pos+1);
+        }
+      }
+      std::sort(s.begin(), s.end());
+      s.erase(std::unique(s.begin(), s.end()), s.end());
+    };
+
+    std::map<state, int> index;
+    std::vector<state> states;
+    state start;
+    for (size_t i = 0; i < items.size(); i++) {
+      start.emplace_back(i, 0);
+    }
+    close(start);
+    index[start] = 0;
+    states.push_back(start);
+    for (size_t i = 0; i < states.size(); i++) {
+      uint64_t mask = 0;
+      for (auto [p, pos]: states[i]) {
+        if (pos == items[p].size()) {
+          mask |= uint64_t(1) << p;
+        }
+      }
+      accept.push_back(mask);
+      for (size_t c = 0; c < num_classes; c++) {
+        action_first.push_back(actions.size());
+        state next;
+        char r = reps[c];
+        for (auto [p, pos]: states[i]) {
+          if (c == 0 || pos == items[p].size() || (c == 1 && !r)) {
+            continue;
           }
-          beg = in;
-          in = std::next(in, 2);
-          month = atoi(std::string(beg, in));
-          if (month < 1 || month > 12) {
-            throw parse_error("month should be between 1 and 12");
+          const auto& it = items[p][pos];
+          bool ok = it.k == kind::digit ? (r >= '0' && r <= '9') : r == it.c;
+          if (ok) {
+            next.emplace_back(p, pos+1);
+            if (it.k != kind::digit) {
+              continue;
+            }
+            // the sign of a year was read when its item is no longer
+            // pending.
+            step op = step::add;
+            if (it.first && it.year) {
+              bool pending = std::binary_search(states[i].begin(), states[i].end(), std::make_pair(p, pos-1));
+              op = pending ? step::set_year : step::set_negative_year;
+            } else if (it.first) {
+              op = step::set;
+            }
+            auto first = actions.begin() + action_first.back();
+            auto same = [&](const action &a) { return a.reg == it.reg; };
+            if (std::find_if(first, actions.end(), same) == actions.end()) {
+              actions.push_back(action{it.reg, op});
+            }
           }
-          break;
-          case 'D':
-          if (yday > 0) {
-            throw parse_error("day of year already set while parsing day of month!");
+        }
+        int to = -1;
+        if (!next.empty()) {
+          close(next);
+          auto found = index.find(next);
+          if (found == index.end()) {
+            to = states.size();
+            index[next] = to;
+            states.push_back(next);
+          } else {
+            to = found->second;
           }
-          beg = in;
-          in = std::next(in, 2);
+        }
+        transitions.push_back(to);
+      }
+    }
+    action_first.push_back(actions.size());
+    uint64_t shadowed = 0;
+    for (auto mask: accept) {
+      if (mask) {
+        shadowed |= mask & ~(mask & -mask);
+      }
+    }
+    cacheable = ~shadowed;
+  }
 
-          day = atoi(std::string(beg, in));
-          if (day < 1 || day > 31) {
-            throw parse_error("day of month should be between 1 and 31");
-          }
-          break;
-          case 'j':
-          if (day > 0 || month > 0) {
-            throw parse_error("day and/or month already set while parsing day of year!");
-          }
-          beg = in;
-          in = std::next(in, 3);
+  instant multi_parser::parse(std::string_view str, size_t* which) const {
+    auto res = try_parse(str, which);
+    if (!res) {
+      throw parse_error(res.error, res.offset);
+    }
+    return res.value;
+  }
 
-          yday = atoi(std::string(beg, in));
-          if (yday < 1 || yday > 366) {
-            throw parse_error("day of year should be between 1 and 366");
-          }
-          break;
-          case 'h':
-          beg = in;
-          in = std::next(in, 2);
+  parse_result multi_parser::try_parse(std::string_view str, size_t* which) const noexcept {
+    // last holds the pattern that matched last, times 2 plus 1 when it also
+    // matched the time before: only then is the stream taken as homogeneous.
+    size_t cached = last.load(std::memory_order_relaxed);
+    size_t k = cached >> 1;
+    parse_result res;
+    if ((cached & 1) && (cacheable >> k & 1)) {
+      res = parsers[k].try_parse(str);
+      if (res) {
+        if (which) {
+          *which = k;
+        }
+        return res;
+      }
+    }
 
-          hour = atoi(std::string(beg, in));
-          if (hour < 0 || hour > 23) {
-            throw parse_error("hour should be between 0 and 23");
-          }
+    int values[max_registers];
+    int s = 0;
+    size_t i = 0;
+    for (; i < str.size(); i++) {
+      int c = classes[static_cast<unsigned char>(str[i])];
+      size_t t = s * num_classes + c;
+      int to = c ? transitions[t] : -1;
+      if (to < 0) {
+        break;
+      }
+      int digit = str[i] - '0';
+      for (uint32_t a = action_first[t]; a < action_first[t+1]; a++) {
+        const auto& act = actions[a];
+        int& v = values[act.reg];
+        switch (act.op) {
+          case step::add:
+          v = v * 10 + digit;
           break;
-          case 'm':
-          beg = in;
-          in = std::next(in, 2);
-
-          minute = atoi(std::string(beg, in));
-          if (minute < 0 || minute > 59) {
-            throw parse_error("minute should be between 0 and 59");
-          }
+          case step::set:
+          v = digit;
           break;
-          case 's':
-          beg = in;
-          in = std::next(in, 2);
-
-          second += atoi(std::string(beg, in));
-          if (second < 0 || second > 59) {
-            throw parse_error("second should be between 0 and 59");
-          }
+          case step::set_year:
+          v = digit;
+          values[act.reg + 1] = 0;
+          break;
+          case step::set_negative_year:
+          v = digit;
+          values[act.reg + 1] = 1;
           break;
-          default:
-          throw parse_error("unknown specifier");
-        }
-      } else {
-        if (*it != *in) {
-          throw parse_error("unexpected character");
         }
-        in = std::next(in);
       }
-      it = std::next(it);
+      s = to;
     }
-    if (*in) {
-      throw parse_error("fail to parse input string");
+    res = parse_result{};
+    if (i < str.size()) {
+      res.error = accept[s] ? parse_errc::trailing_input : parse_errc::unexpected_character;
+      res.offset = i;
+      return res;
     }
-    if (yday > 0) {
-      month++;
-      for (auto d: year_days) {
-        if (yday < d) {
-          break;
+    if (!accept[s]) {
+      res.error = parse_errc::unexpected_end;
+      res.offset = i;
+      return res;
+    }
+    for (uint64_t mask = accept[s]; mask; mask &= mask - 1) {
+      k = __builtin_ctzll(mask);
+      res = finish(k, values);
+      if (res) {
+        size_t repeat = (cached >> 1) == k;
+        last.store(k << 1 | repeat, std::memory_order_relaxed);
+        if (which) {
+          *which = k;
         }
-        month++;
-      }
-      day = yday - year_days[month-1] - 1;
-    } else {
-      if (day > month_days[month]) {
-        throw parse_error("invalid day for given month");
+        break;
       }
     }
-    return instant(year, month, day, hour, minute, second);
+    return res;
   }
 
-  instant instant::now() {
-    return instant(std::time(nullptr));
+  // finish checks the fields read for pattern k, in the order of the
+  // pattern, and makes the instant. The fields have a fixed width, so their
+  // offsets only depend on the sign of the year.
+  parse_result multi_parser::finish(size_t k, const int* values) const noexcept {
+    parse_result res;
+    parser::fields f;
+    size_t offset = 0;
+    const auto& ops = parsers[k].ops;
+    for (size_t j = 0; j < ops.size(); j++) {
+      const auto& o = ops[j];
+      if (o.field == parser::field_t::literal) {
+        offset += o.length;
+        continue;
+      }
+      uint16_t reg = registers[k][j];
+      int v = values[reg];
+      if (o.field == parser::field_t::year && values[reg + 1]) {
+        v = -v;
+        offset++;
+      }
+      res.error = parser::set_field(o.field, v, offset, f);
+      if (res.error != parse_errc::none) {
+        res.offset = offset;
+        return res;
+      }
+      offset += o.width;
+    }
+    res.error = parser::make_instant(f, res.value);
+    if (res.error != parse_errc::none) {
+      res.offset = f.day_offset;
+    }
+    return res;
   }
 
-  instant::instant(): timestamp(0) {}
-
-  instant::instant(long long w, int ms): timestamp(w*millis) {
-    timestamp += ms;
+  // probe_line returns the offset of the first line starting at or after pos
+  // with a valid timestamp, or the size of the text when there is none.
+  static size_t probe_line(std::string_view text, const parser &p, size_t column, size_t pos, instant &w) {
+    const char* data = text.data();
+    size_t size = text.size();
+    if (pos > 0) {
+      auto nl = static_cast<const char*>(std::memchr(data + pos - 1, '\n', size - pos + 1));
+      pos = nl ? nl - data + 1 : size;
+    }
+    while (pos < size) {
+      auto nl = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+      size_t eol = nl ? nl - data : size;
+      if (pos + column < eol) {
+        auto res = p.try_parse_prefix(data + pos + column, data + eol);
+        if (res) {
+          w = res.value;
+          return pos;
+        }
+      }
+      pos = nl ? eol + 1 : size;
+    }
+    return size;
   }
 
-  std::pair<int, int> normalize(int high, int low, int base) {
-    if (low < 0) {
-      int n = ((-low -1) / base) + 1;
-      high -= n;
-      low += n * base;
-    }
-    if (low > base) {
-      int n = low/base;
-      high += n;
-      low -= n * base;
+  size_t search_lines(std::string_view text, const parser &p, size_t column, const instant &w) {
+    size_t lo = 0;
+    size_t hi = text.size();
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      instant t;
+      size_t at = probe_line(text, p, column, mid, t);
+      if (at < text.size() && t.is_before(w)) {
+        lo = at + 1;
+      } else {
+        hi = mid;
+      }
     }
-    return std::make_pair(high, low);
+    instant t;
+    return probe_line(text, p, column, lo, t);
   }
 
-  instant::instant(int year, int mon, int day, int hour, int min, int sec): instant() {
-    std::pair<int, int> norm;
-    norm = normalize(year, mon, 12);
-    year = norm.first;
-    mon = norm.second;
+  line_range search_lines(std::string_view text, const parser &p, size_t column, const instant &from, const instant &to) {
+    size_t first = search_lines(text, p, column, from);
+    size_t last = first;
+    if (from.is_before(to)) {
+      last = first + search_lines(text.substr(first), p, column, to);
+    }
+    return line_range{first, last};
+  }
 
-    norm = normalize(min, sec, 60);
-    min = norm.first;
-    sec = norm.second;
+  static void split_scalar(const long long* millis, size_t n, const civil_columns &out) {
+    for (size_t i = 0; i < n; i++) {
+      long long secs = floor_div(millis[i], 1000);
+      long long days = floor_div(secs, secondsPerDay);
+      std::tie(out.year[i], out.month[i], out.day[i]) = civil_from_days(days);
+
+      int sod = secs - days * secondsPerDay;
+      out.hour[i] = sod / secondsPerHour;
+      sod -= out.hour[i] * secondsPerHour;
+      out.minute[i] = sod / secondsPerMin;
+      out.second[i] = sod - out.minute[i] * secondsPerMin;
+    }
+  }
 
-    norm = normalize(hour, min, 60);
-    hour = norm.first;
-    min = norm.second;
+#ifdef EVER_X86
+  // The kernels below do the same computations as split_scalar with doubles:
+  // every value involved is an integer small enough to be exact and the
+  // quotient of two of them is never close enough to an integer to be
+  // rounded to it, so flooring the quotient gives the integer division.
+  // Integers are converted to doubles with the 2^52+2^51 trick that requires
+  // values in [-2^51, 2^51]. Blocks with values outside are done by
+  // split_scalar.
+  const long long batchLimit = 1LL << 51;
+
+  static bool batch_in_range(const long long* millis, size_t n) {
+    bool ok = true;
+    for (size_t i = 0; i < n; i++) {
+      ok &= millis[i] > -batchLimit && millis[i] < batchLimit;
+    }
+    return ok;
+  }
 
-    norm = normalize(day, hour, 24);
-    day = norm.first;
-    hour = norm.second;
+  __attribute__((target("avx2")))
+  static inline __m256d fdiv(__m256d v, double d) {
+    return _mm256_floor_pd(_mm256_div_pd(v, _mm256_set1_pd(d)));
+  }
 
-    long long y = year - epoch;
-    long long n = y / 400;
-    y -= 400 * n;
-    long long d = days400Years * n;
+  __attribute__((target("avx2")))
+  static inline __m256d mul(__m256d v, double d) {
+    return _mm256_mul_pd(v, _mm256_set1_pd(d));
+  }
 
-    n = y / 100;
-    y -= 100 * n;
-    d += days100Years * n;
+  __attribute__((target("avx2")))
+  static inline void store(int* dst, __m256d v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm256_cvttpd_epi32(v));
+  }
 
-    n = y / 4;
-    y -= 4 * n;
-    d += days4Years * n;
+  __attribute__((target("avx2")))
+  static void split_avx2(const long long* millis, size_t n, const civil_columns &out) {
+    const __m256i magici = _mm256_set1_epi64x(0x4338000000000000LL);
+    const __m256d magicd = _mm256_set1_pd(6755399441055744.0);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      if (!batch_in_range(millis+i, 4)) {
+        civil_columns sub{out.year+i, out.month+i, out.day+i, out.hour+i, out.minute+i, out.second+i};
+        split_scalar(millis+i, 4, sub);
+        continue;
+      }
+      __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(millis+i));
+      __m256d ms = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(raw, magici)), magicd);
+
+      __m256d secs = fdiv(ms, 1000);
+      __m256d days = fdiv(secs, secondsPerDay);
+      __m256d sod = _mm256_sub_pd(secs, mul(days, secondsPerDay));
+      __m256d hour = fdiv(sod, secondsPerHour);
+      sod = _mm256_sub_pd(sod, mul(hour, secondsPerHour));
+      __m256d min = fdiv(sod, secondsPerMin);
+      __m256d sec = _mm256_sub_pd(sod, mul(min, secondsPerMin));
+
+      __m256d z = _mm256_add_pd(days, _mm256_set1_pd(daysToEpoch));
+      __m256d era = fdiv(z, days400Years);
+      __m256d doe = _mm256_sub_pd(z, mul(era, days400Years));
+      __m256d yoe = _mm256_sub_pd(doe, fdiv(doe, 1460));
+      yoe = _mm256_add_pd(yoe, fdiv(doe, 36524));
+      yoe = _mm256_sub_pd(yoe, fdiv(doe, 146096));
+      yoe = fdiv(yoe, 365);
+      __m256d doy = _mm256_add_pd(mul(yoe, 365), fdiv(yoe, 4));
+      doy = _mm256_sub_pd(doe, _mm256_sub_pd(doy, fdiv(yoe, 100)));
+      __m256d mp = fdiv(_mm256_add_pd(mul(doy, 5), _mm256_set1_pd(2)), 153);
+      __m256d day = _mm256_add_pd(mul(mp, 153), _mm256_set1_pd(2));
+      day = _mm256_add_pd(_mm256_sub_pd(doy, fdiv(day, 5)), _mm256_set1_pd(1));
+      __m256d late = _mm256_cmp_pd(mp, _mm256_set1_pd(10), _CMP_GE_OQ);
+      __m256d mon = _mm256_add_pd(mp, _mm256_set1_pd(3));
+      mon = _mm256_sub_pd(mon, _mm256_and_pd(late, _mm256_set1_pd(12)));
+      __m256d year = _mm256_add_pd(yoe, mul(era, 400));
+      year = _mm256_add_pd(year, _mm256_and_pd(late, _mm256_set1_pd(1)));
+
+      store(out.year+i, year);
+      store(out.month+i, mon);
+      store(out.day+i, day);
+      store(out.hour+i, hour);
+      store(out.minute+i, min);
+      store(out.second+i, sec);
+    }
+    civil_columns sub{out.year+i, out.month+i, out.day+i, out.hour+i, out.minute+i, out.second+i};
+    split_scalar(millis+i, n-i, sub);
+  }
 
-    n = y;
-    d += daysYears * n;
+  __attribute__((target("sse4.1")))
+  static inline __m128d fdiv(__m128d v, double d) {
+    return _mm_floor_pd(_mm_div_pd(v, _mm_set1_pd(d)));
+  }
 
-    d += year_days[mon-1];
-    if (year > epoch && is_leap(year) && mon > 2) {
-      d++;
-    }
-    d += day - 1;
+  __attribute__((target("sse4.1")))
+  static inline __m128d mul(__m128d v, double d) {
+    return _mm_mul_pd(v, _mm_set1_pd(d));
+  }
 
-    long long seconds = 0;
-    seconds += d * secondsPerDay;
-    seconds += hour * secondsPerHour;
-    seconds += min * secondsPerMin;
-    seconds += sec;
+  __attribute__((target("sse4.1")))
+  static inline void store(int* dst, __m128d v) {
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_cvttpd_epi32(v));
+  }
 
-    if (year < epoch) {
-      if (mon <= 2 && is_leap(year)) {
-        seconds -= secondsPerDay;
+  __attribute__((target("sse4.1")))
+  static void split_sse4(const long long* millis, size_t n, const civil_columns &out) {
+    const __m128i magici = _mm_set1_epi64x(0x4338000000000000LL);
+    const __m128d magicd = _mm_set1_pd(6755399441055744.0);
+
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+      if (!batch_in_range(millis+i, 2)) {
+        civil_columns sub{out.year+i, out.month+i, out.day+i, out.hour+i, out.minute+i, out.second+i};
+        split_scalar(millis+i, 2, sub);
+        continue;
       }
-      seconds += adjust_pre_epoch(year);
-    } else {
-      seconds += adjust_post_epoch(year);
+      __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(millis+i));
+      __m128d ms = _mm_sub_pd(_mm_castsi128_pd(_mm_add_epi64(raw, magici)), magicd);
+
+      __m128d secs = fdiv(ms, 1000);
+      __m128d days = fdiv(secs, secondsPerDay);
+      __m128d sod = _mm_sub_pd(secs, mul(days, secondsPerDay));
+      __m128d hour = fdiv(sod, secondsPerHour);
+      sod = _mm_sub_pd(sod, mul(hour, secondsPerHour));
+      __m128d min = fdiv(sod, secondsPerMin);
+      __m128d sec = _mm_sub_pd(sod, mul(min, secondsPerMin));
+
+      __m128d z = _mm_add_pd(days, _mm_set1_pd(daysToEpoch));
+      __m128d era = fdiv(z, days400Years);
+      __m128d doe = _mm_sub_pd(z, mul(era, days400Years));
+      __m128d yoe = _mm_sub_pd(doe, fdiv(doe, 1460));
+      yoe = _mm_add_pd(yoe, fdiv(doe, 36524));
+      yoe = _mm_sub_pd(yoe, fdiv(doe, 146096));
+      yoe = fdiv(yoe, 365);
+      __m128d doy = _mm_add_pd(mul(yoe, 365), fdiv(yoe, 4));
+      doy = _mm_sub_pd(doe, _mm_sub_pd(doy, fdiv(yoe, 100)));
+      __m128d mp = fdiv(_mm_add_pd(mul(doy, 5), _mm_set1_pd(2)), 153);
+      __m128d day = _mm_add_pd(mul(mp, 153), _mm_set1_pd(2));
+      day = _mm_add_pd(_mm_sub_pd(doy, fdiv(day, 5)), _mm_set1_pd(1));
+      __m128d late = _mm_cmpge_pd(mp, _mm_set1_pd(10));
+      __m128d mon = _mm_add_pd(mp, _mm_set1_pd(3));
+      mon = _mm_sub_pd(mon, _mm_and_pd(late, _mm_set1_pd(12)));
+      __m128d year = _mm_add_pd(yoe, mul(era, 400));
+      year = _mm_add_pd(year, _mm_and_pd(late, _mm_set1_pd(1)));
+
+      store(out.year+i, year);
+      store(out.month+i, mon);
+      store(out.day+i, day);
+      store(out.hour+i, hour);
+      store(out.minute+i, min);
+      store(out.second+i, sec);
     }
-    timestamp = seconds * millis;
+    civil_columns sub{out.year+i, out.month+i, out.day+i, out.hour+i, out.minute+i, out.second+i};
+    split_scalar(millis+i, n-i, sub);
   }
+#endif
 
-  instant::instant(const instant &w): timestamp(w.timestamp) {}
+  using split_func = void (*)(const long long*, size_t, const civil_columns&);
 
-  int instant::adjust_pre_epoch(int year) const {
-    int mod = year % 100;
-    int leap = year % 4;
-    if (mod < 70 && leap == 3) {
-      return -secondsPerDay;
+  static split_func select_split() {
+#ifdef EVER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return split_avx2;
     }
-    int delta = 1900 - (year - mod);
-    if (year < 1900 && delta % 400 == 0 && mod > 70) {
-      return leap == 3 ? -secondsPerDay : 0;
+    if (__builtin_cpu_supports("sse4.1")) {
+      return split_sse4;
     }
-    if (mod >= 72 && leap < 3) {
-      return secondsPerDay;
-    }
-    return 0;
+#endif
+    return split_scalar;
   }
 
-  int instant::adjust_post_epoch(int year) const {
-    int mod = year % 100;
-    int leap = year % 4;
+  void split_batch(const long long* millis, size_t n, const civil_columns &out) {
+    static const split_func split = select_split();
+    split(millis, n, out);
+  }
 
-    int s = 0;
-    if (leap == 1) {
-      s = secondsPerDay;
-    }
-    if (mod == 0 || mod >= 70) {
-      year = mod != 0 ? year - mod - 1900 : year;
-      if (year % 400 != 0) {
-        s += secondsPerDay;
+  void split_batch(const instant* first, size_t n, const civil_columns &out) {
+    long long millis[256];
+    for (size_t i = 0; i < n; i += 256) {
+      size_t z = std::min(n - i, size_t(256));
+      for (size_t j = 0; j < z; j++) {
+        millis[j] = first[i+j].timestamp;
       }
+      civil_columns sub{out.year+i, out.month+i, out.day+i, out.hour+i, out.minute+i, out.second+i};
+      split_batch(millis, z, sub);
     }
-    return s;
   }
 
-  bool instant::operator==(const instant &w) const {
-    return equal(w);
+  instant_column::instant_column(const instant* first, size_t n) {
+    values.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+      push_back(first[i]);
+    }
   }
 
-  bool instant::operator!=(const instant &w) const {
-    return !equal(w);
+  long long instant_column::in_scale(const instant &w, instant::epoch_t zero) {
+    if (w.zero == zero) {
+      return w.timestamp;
+    }
+    switch (zero) {
+      case instant::epoch_t::gps:
+      return w.to_gps().timestamp;
+      case instant::epoch_t::tai:
+      return w.to_tai().timestamp;
+      default:
+      return w.to_unix().timestamp;
+    }
   }
 
-  bool instant::operator<(const instant &w) const {
-    return is_before(w);
+  void instant_column::push_back(const instant &w) {
+    if (values.empty()) {
+      zero = w.zero;
+    }
+    values.push_back(in_scale(w, zero));
   }
 
-  bool instant::operator<=(const instant &w) const {
-    return is_before(w) || equal(w);
+  instant instant_column::operator[](size_t i) const {
+    return make(values[i]);
   }
 
-  bool instant::operator>(const instant &w) const {
-    return is_after(w);
+  instant instant_column::make(long long v) const {
+    instant w;
+    w.timestamp = v;
+    w.zero = zero;
+    return w;
   }
 
-  bool instant::operator>=(const instant &w) const {
-    return is_after(w) || equal(w);
+  // the kernels below take the rows of a column and a range [lo, hi): minmax
+  // gives the smallest and the largest value, select sets the bits of the
+  // rows in the range and returns their number.
+  static void minmax_scalar(const long long* v, size_t n, long long &lo, long long &hi) {
+    for (size_t i = 0; i < n; i++) {
+      lo = std::min(lo, v[i]);
+      hi = std::max(hi, v[i]);
+    }
   }
 
-  instant instant::operator-() const {
-    return instant{-timestamp};
+  static size_t select_scalar(const long long* v, size_t n, long long lo, long long hi, uint64_t* bits) {
+    size_t count = 0;
+    for (size_t w = 0; w < n; w += 64) {
+      uint64_t word = 0;
+      size_t end = std::min(n, w + 64);
+      for (size_t i = w; i < end; i++) {
+        word |= uint64_t(v[i] >= lo && v[i] < hi) << (i - w);
+      }
+      bits[w / 64] = word;
+      count += __builtin_popcountll(word);
+    }
+    return count;
   }
 
-  instant instant::operator+(int w) const {
-    return add(w);
+#ifdef EVER_X86
+  __attribute__((target("avx2")))
+  static void minmax_avx2(const long long* v, size_t n, long long &lo, long long &hi) {
+    size_t i = 0;
+    if (n >= 4) {
+      __m256i vlo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v));
+      __m256i vhi = vlo;
+      for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i));
+        vlo = _mm256_blendv_epi8(vlo, x, _mm256_cmpgt_epi64(vlo, x));
+        vhi = _mm256_blendv_epi8(vhi, x, _mm256_cmpgt_epi64(x, vhi));
+      }
+      alignas(32) long long a[4], b[4];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(a), vlo);
+      _mm256_store_si256(reinterpret_cast<__m256i*>(b), vhi);
+      for (int j = 0; j < 4; j++) {
+        lo = std::min(lo, a[j]);
+        hi = std::max(hi, b[j]);
+      }
+    }
+    minmax_scalar(v + i, n - i, lo, hi);
   }
 
-  instant instant::operator+=(int w) const {
-    return add(w);
+  // v >= lo && v < hi is computed as !(lo > v) && (hi > v).
+  __attribute__((target("avx2")))
+  static size_t select_avx2(const long long* v, size_t n, long long lo, long long hi, uint64_t* bits) {
+    __m256i vlo = _mm256_set1_epi64x(lo);
+    __m256i vhi = _mm256_set1_epi64x(hi);
+    size_t count = 0;
+    size_t w = 0;
+    for (; w + 64 <= n; w += 64) {
+      uint64_t word = 0;
+      for (size_t i = 0; i < 64; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + w + i));
+        __m256i in = _mm256_andnot_si256(_mm256_cmpgt_epi64(vlo, x), _mm256_cmpgt_epi64(vhi, x));
+        word |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(in))) << i;
+      }
+      bits[w / 64] = word;
+      count += __builtin_popcountll(word);
+    }
+    return count + select_scalar(v + w, n - w, lo, hi, bits + w / 64);
   }
-
-  instant instant::operator-(int w)  const {
-    return add(-w);
+#endif
+
+  using minmax_func = void (*)(const long long*, size_t, long long&, long long&);
+  using select_func = size_t (*)(const long long*, size_t, long long, long long, uint64_t*);
+
+  static bool column_avx2() {
+#ifdef EVER_X86
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
   }
 
-  instant instant::operator-=(int w)  const {
-    return add(-w);
+  static minmax_func select_minmax() {
+#ifdef EVER_X86
+    if (column_avx2()) {
+      return minmax_avx2;
+    }
+#endif
+    return minmax_scalar;
   }
 
-  long long instant::unix() const {
-    return get_seconds();
+  static select_func select_select() {
+#ifdef EVER_X86
+    if (column_avx2()) {
+      return select_avx2;
+    }
+#endif
+    return select_scalar;
   }
 
-  std::tuple<int,int,int> instant::date() const {
-    return split_date();
+  instant instant_column::min() const {
+    static const minmax_func minmax = select_minmax();
+    if (values.empty()) {
+      return instant();
+    }
+    long long lo = values[0];
+    long long hi = values[0];
+    minmax(values.data(), values.size(), lo, hi);
+    return make(lo);
   }
 
-  std::tuple<int,int,int> instant::time() const {
-    return split_time();
+  instant instant_column::max() const {
+    static const minmax_func minmax = select_minmax();
+    if (values.empty()) {
+      return instant();
+    }
+    long long lo = values[0];
+    long long hi = values[0];
+    minmax(values.data(), values.size(), lo, hi);
+    return make(hi);
   }
 
-  int instant::year() const {
-    auto t = split_date();
-    return std::get<0>(t);
+  size_t instant_column::before(const instant &w, uint64_t* bits) const {
+    static const select_func select = select_select();
+    return select(values.data(), values.size(), LLONG_MIN, in_scale(w, zero), bits);
   }
 
-  int instant::year_day() const {
-    int y, m, d;
-    std::tie(y, m, d) = split_date();
-    return year_day(y, m, d);
+  size_t instant_column::filter(const instant &from, const instant &to, uint64_t* bits) const {
+    static const select_func select = select_select();
+    return select(values.data(), values.size(), in_scale(from, zero), in_scale(to, zero), bits);
   }
 
-  int instant::month() const {
-    auto t = split_date();
-    return std::get<1>(t);
+  void add_batch(const instant* first, size_t n, int years, int months, int days, instant* out) {
+    const long long msPerDay = secondsPerDay * instant::millis;
+    if (!years && !months) {
+      long long shift = days * msPerDay;
+      for (size_t i = 0; i < n; i++) {
+        out[i] = first[i];
+        out[i].timestamp = first[i].timestamp + shift;
+      }
+      return;
+    }
+    long long last = LLONG_MIN;
+    long long shift = 0;
+    for (size_t i = 0; i < n; i++) {
+      long long day = floor_div(first[i].timestamp, msPerDay);
+      if (day != last) {
+        last = day;
+        shift = first[i].add(years, months, days).timestamp - first[i].timestamp;
+      }
+      out[i] = first[i];
+      out[i].timestamp = first[i].timestamp + shift;
+    }
   }
 
-  int instant::month_day() const {
-    auto t = split_date();
-    return std::get<2>(t);
-  }
+  // sort_min is the number of instants a thread should at least sort.
+  static constexpr size_t sort_min = 1 << 16;
 
-  int instant::week_day() const {
-    // 1st january of 1970 was a thursday (5th day of the week)
-    int wd = (get_seconds() + (5*secondsPerDay)) % secondsPerWeek;
-    return wd/secondsPerDay;
-  }
+  void sort(instant* first, size_t n, unsigned threads) {
+    if (!threads) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto key = [](const instant &w) { return radix_key(w); };
+    size_t parts = std::min<size_t>(threads, n / sort_min);
+    if (parts < 2) {
+      radix_sort(first, n, key);
+      return;
+    }
 
-  int instant::iso_week_day() const {
-    return week_day()-1;
+    std::vector<const instant*> runs(parts);
+    std::vector<size_t> sizes(parts);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < parts; i++) {
+      size_t beg = n * i / parts;
+      size_t end = n * (i + 1) / parts;
+      runs[i] = first + beg;
+      sizes[i] = end - beg;
+      if (i) {
+        workers.emplace_back([=] { radix_sort(first + beg, end - beg, key); });
+      }
+    }
+    radix_sort(first, sizes[0], key);
+    for (auto& w: workers) {
+      w.join();
+    }
+    std::vector<instant> out(n);
+    merge_runs(runs.data(), sizes.data(), parts, out.data());
+    std::copy(out.begin(), out.end(), first);
   }
 
-  int instant::hour() const {
-    return std::get<0>(split_time());
+  void merge_runs(const instant* const* runs, const size_t* sizes, size_t k, instant* out) {
+    // the heap keeps the next instant of each run that is not empty.
+    using head = std::pair<uint64_t, size_t>;
+    std::priority_queue<head, std::vector<head>, std::greater<head>> heap;
+    std::vector<size_t> pos(k);
+    for (size_t i = 0; i < k; i++) {
+      if (sizes[i]) {
+        heap.emplace(radix_key(runs[i][0]), i);
+      }
+    }
+    while (!heap.empty()) {
+      size_t i = heap.top().second;
+      heap.pop();
+      // take from the same run as long as it stays ahead of the others.
+      uint64_t limit = heap.empty() ? UINT64_MAX : heap.top().first;
+      size_t next = heap.empty() ? k : heap.top().second;
+      do {
+        *out++ = runs[i][pos[i]++];
+      } while (pos[i] < sizes[i] && (radix_key(runs[i][pos[i]]) < limit || (radix_key(runs[i][pos[i]]) == limit && i < next)));
+      if (pos[i] < sizes[i]) {
+        heap.emplace(radix_key(runs[i][pos[i]]), i);
+      }
+    }
   }
 
-  int instant::minutes() const {
-    return std::get<1>(split_time());
+  // bucket_scalar keeps the bucket [lo, hi) of the last value, so that
+  // sorted input only computes a new bucket when it leaves the current one.
+  static void bucket_scalar(const long long* millis, size_t n, time_unit u, bool up, long long* out) {
+    long long lo = 1;
+    long long hi = 0;
+    for (size_t i = 0; i < n; i++) {
+      long long v = millis[i];
+      if (v < lo || v >= hi) {
+        lo = bucket_start(v, u);
+        hi = bucket_next(lo, u);
+      }
+      out[i] = up && v != lo ? hi : lo;
+    }
   }
 
-  int instant::seconds() const {
-    return std::get<2>(split_time());
+  // bucket_fixed gives the length of the units up to the week and the start
+  // of one of their buckets, 0 for the units of variable length.
+  static long long bucket_fixed(time_unit u, long long &origin) {
+    origin = bucket_start(0, u);
+    switch (u) {
+      case time_unit::month:
+      case time_unit::year:
+      return 0;
+      default:
+      return bucket_next(origin, u) - origin;
+    }
   }
 
-  double instant::jd() const {
-    int y, m, d, h, s;
-    std::tie(y, m, d) = split_date();
-
-    int day = (1461 * (y + 4800 + (m - 14) / 12)) / 4;
-    day += (367 * (m - 2 - 12 * ((m - 14) / 12))) / 12;
-    day -= (3 * ((y + 4900 + (m - 14) / 12) / 100)) / 4;
-    day += d - 32075;
-
-    std::tie(h, m, s) = split_time();
+#ifdef EVER_X86
+  // bucket_avx2 floors (v - origin) / len with doubles: the quotient is
+  // corrected with the remainder that is exact since all values are integers
+  // below 2^53. Blocks with values outside [-2^51, 2^51] are done by
+  // bucket_scalar.
+  __attribute__((target("avx2")))
+  static void bucket_avx2(const long long* millis, size_t n, time_unit u, bool up, long long* out) {
+    long long origin;
+    long long len = bucket_fixed(u, origin);
+    const __m256i magici = _mm256_set1_epi64x(0x4338000000000000LL);
+    const __m256d magicd = _mm256_set1_pd(6755399441055744.0);
+    const __m256d vlen = _mm256_set1_pd(len);
+    const __m256d vorigin = _mm256_set1_pd(origin);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      if (!batch_in_range(millis+i, 4)) {
+        bucket_scalar(millis+i, 4, u, up, out+i);
+        continue;
+      }
+      __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(millis+i));
+      __m256d v = _mm256_sub_pd(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(raw, magici)), magicd), vorigin);
+      __m256d q = _mm256_floor_pd(_mm256_div_pd(v, vlen));
+      __m256d r = _mm256_sub_pd(v, _mm256_mul_pd(q, vlen));
+      q = _mm256_sub_pd(q, _mm256_and_pd(_mm256_cmp_pd(r, zero, _CMP_LT_OQ), one));
+      q = _mm256_add_pd(q, _mm256_and_pd(_mm256_cmp_pd(r, vlen, _CMP_GE_OQ), one));
+      __m256d lo = _mm256_mul_pd(q, vlen);
+      if (up) {
+        lo = _mm256_add_pd(lo, _mm256_and_pd(_mm256_cmp_pd(lo, v, _CMP_NEQ_OQ), vlen));
+      }
+      lo = _mm256_add_pd(_mm256_add_pd(lo, vorigin), magicd);
+      __m256i res = _mm256_sub_epi64(_mm256_castpd_si256(lo), magici);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(out+i), res);
+    }
+    bucket_scalar(millis+i, n-i, u, up, out+i);
+  }
+#endif
 
-    double frac = (((s / 60.0) + m) / 60.0) / 24.0;
+  using bucket_func = void (*)(const long long*, size_t, time_unit, bool, long long*);
 
-    return day+frac-0.5;
+  static bucket_func select_bucket() {
+#ifdef EVER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return bucket_avx2;
+    }
+#endif
+    return bucket_scalar;
   }
 
-  double instant::mjd() const {
-    return jd() - 2400000.5;
+  static void bucket_batch(const long long* millis, size_t n, time_unit u, bool up, long long* out) {
+    static const bucket_func fixed = select_bucket();
+    long long origin;
+    if (bucket_fixed(u, origin)) {
+      fixed(millis, n, u, up, out);
+    } else {
+      bucket_scalar(millis, n, u, up, out);
+    }
   }
 
-  long long instant::diff(const instant &w) const {
-    return get_seconds() - w.get_seconds();
+  void floor_batch(const long long* millis, size_t n, time_unit u, long long* out) {
+    bucket_batch(millis, n, u, false, out);
   }
 
-  long long instant::diff_millis(const instant &w) const {
-    return timestamp - w.timestamp;
+  void ceil_batch(const long long* millis, size_t n, time_unit u, long long* out) {
+    bucket_batch(millis, n, u, true, out);
   }
 
-  instant instant::add(int sec) const {
-    return instant(get_seconds()+sec, get_millis());
+  void floor_batch(const instant* first, size_t n, time_unit u, instant* out) {
+    long long in[256];
+    long long res[256];
+    for (size_t i = 0; i < n; i += 256) {
+      size_t z = std::min(n - i, size_t(256));
+      for (size_t j = 0; j < z; j++) {
+        in[j] = first[i+j].timestamp;
+      }
+      bucket_batch(in, z, u, false, res);
+      for (size_t j = 0; j < z; j++) {
+        out[i+j] = first[i+j];
+        out[i+j].timestamp = res[j];
+      }
+    }
   }
 
-  instant instant::add(int y, int m, int d) const {
-    int year, mon, day, hour, min, sec;
-    std::tie(year, mon, day) = split_date();
-    std::tie(hour, min, sec) = split_time();
-
-    year += y;
-    mon += m;
-    day += d;
-
-    while (mon <= 0) {
-      year--;
-      mon = 12 + mon;
-    }
-    while (day <= 0) {
-      mon--;
-      if (mon == 0) {
-        mon = 12;
-        year--;
+  void ceil_batch(const instant* first, size_t n, time_unit u, instant* out) {
+    long long in[256];
+    long long res[256];
+    for (size_t i = 0; i < n; i += 256) {
+      size_t z = std::min(n - i, size_t(256));
+      for (size_t j = 0; j < z; j++) {
+        in[j] = first[i+j].timestamp;
       }
-      day = month_days[mon] + day;
-      if (is_leap(year) && mon == 2) {
-        day--;
+      bucket_batch(in, z, u, true, res);
+      for (size_t j = 0; j < z; j++) {
+        out[i+j] = first[i+j];
+        out[i+j].timestamp = res[j];
       }
     }
-    return instant(year, mon, day, hour, min, sec);
   }
 
-  bool instant::is_before(const instant &w) const {
-    return timestamp < w.timestamp;
+  // split_list calls fn for each part of str between the separators.
+  template <typename Fn>
+  static void split_list(std::string_view str, char sep, Fn fn) {
+    size_t pos = 0;
+    while (true) {
+      size_t end = str.find(sep, pos);
+      fn(str.substr(pos, end == std::string_view::npos ? end : end - pos));
+      if (end == std::string_view::npos) {
+        break;
+      }
+      pos = end + 1;
+    }
   }
 
-  bool instant::is_after(const instant &w) const {
-    return timestamp > w.timestamp;
-  }
-  bool instant::equal(const instant &w) const {
-    return timestamp == w.timestamp;
+  static std::string upper(std::string_view str) {
+    std::string s(str);
+    for (auto& c: s) {
+      if (c >= 'a' && c <= 'z') {
+        c -= 'a' - 'A';
+      }
+    }
+    return s;
   }
 
-  bool instant::is_zero() {
-    return timestamp == 0;
-  }
+  static const char* const month_names[] = {"JAN", "FEB", "MAR", "APR", "MAY", "JUN", "JUL", "AUG", "SEP", "OCT", "NOV", "DEC"};
+  static const char* const day_names[] = {"SUN", "MON", "TUE", "WED", "THU", "FRI", "SAT"};
+  static const char* const rrule_days[] = {"SU", "MO", "TU", "WE", "TH", "FR", "SA"};
 
-  // instant instant::to_unix() const {
-  //   if (zero == epoch_t::unix) {
-  //     return *this;
-  //   }
-  // }
+  [[noreturn]] static void bad_rule(std::string_view what, std::string_view str) {
+    throw parse_error("recurrence: invalid " + std::string(what) + ": '" + std::string(str) + "'");
+  }
 
-  instant instant::to_gps() const {
-    if (zero == epoch_t::gps) {
-      return *this;
+  // read_value reads a number or one of names (whose index is added to
+  // first) and checks that it is in [lo, hi].
+  static int read_value(std::string_view str, int lo, int hi, const char* const* names, size_t count, int first, std::string_view what) {
+    if (names) {
+      auto u = upper(str);
+      for (size_t i = 0; i < count; i++) {
+        if (u == names[i]) {
+          return first + i;
+        }
+      }
     }
-    int sec = 0;
-    for (auto s: leap_seconds) {
-      if (timestamp < s * millis) {
-        break;
+    bool neg = !str.empty() && str[0] == '-';
+    if (neg) {
+      str.remove_prefix(1);
+    }
+    if (str.empty() || str.size() > 4) {
+      bad_rule(what, str);
+    }
+    int v = 0;
+    for (char c: str) {
+      if (c < '0' || c > '9') {
+        bad_rule(what, str);
       }
-      sec++;
+      v = v * 10 + (c - '0');
     }
-    auto i = add(sec);
-    i.zero = epoch_t::gps;
-    return i;
+    v = neg ? -v : v;
+    if (v < lo || v > hi) {
+      bad_rule(what, str);
+    }
+    return v;
   }
 
-  // %S: timestamp
-  // %Y: year
-  // %M: month
-  // %D: day
-  // %j: year day
-  // %h: hour
-  // %m: minute
-  // %s: second
-  // %f: millisecond
-  // %%: literal %
-  std::string instant::format(std::string pattern) const {
-    std::ostringstream os;
-    auto it = pattern.begin();
+  // cron_field reads one field of a cron expression into a bitset where the
+  // bit v is set for each value v. any tells whether the field is a star.
+  static uint64_t cron_field(std::string_view field, int lo, int hi, const char* const* names, size_t count, int first, std::string_view what, bool &any) {
+    uint64_t bits = 0;
+    any = field == "*" || field == "?";
+    split_list(field, ',', [&](std::string_view item) {
+      int step = 1;
+      size_t slash = item.find('/');
+      if (slash != std::string_view::npos) {
+        step = read_value(item.substr(slash+1), 1, hi, nullptr, 0, 0, what);
+        item = item.substr(0, slash);
+      }
+      int from = lo;
+      int to = hi;
+      if (item != "*" && item != "?") {
+        size_t dash = item.find('-', 1);
+        from = read_value(item.substr(0, dash), lo, hi, names, count, first, what);
+        to = from;
+        if (dash != std::string_view::npos) {
+          to = read_value(item.substr(dash+1), lo, hi, names, count, first, what);
+        } else if (slash != std::string_view::npos) {
+          to = hi;
+        }
+      }
+      if (from > to) {
+        bad_rule(what, item);
+      }
+      for (int v = from; v <= to; v += step) {
+        bits |= uint64_t(1) << v;
+      }
+    });
+    return bits;
+  }
 
-    int y, mon, d;
-    int h, min, s;
+  recurrence recurrence::cron(std::string_view expr) {
+    static const std::pair<std::string_view, std::string_view> macros[] = {
+      {"@yearly", "0 0 1 1 *"},
+      {"@annually", "0 0 1 1 *"},
+      {"@monthly", "0 0 1 * *"},
+      {"@weekly", "0 0 * * 0"},
+      {"@daily", "0 0 * * *"},
+      {"@midnight", "0 0 * * *"},
+      {"@hourly", "0 * * * *"},
+    };
+    for (auto [name, value]: macros) {
+      if (expr == name) {
+        expr = value;
+        break;
+      }
+    }
 
-    std::tie(y, mon, d) = split_date();
-    std::tie(h, min, s) = split_time();
-    int yd = year_day(y, mon, d);
+    std::vector<std::string_view> fields;
+    size_t pos = 0;
+    while (pos < expr.size()) {
+      size_t beg = expr.find_first_not_of(" \t", pos);
+      if (beg == std::string_view::npos) {
+        break;
+      }
+      pos = std::min(expr.find_first_of(" \t", beg), expr.size());
+      fields.push_back(expr.substr(beg, pos - beg));
+    }
+    if (fields.size() == 5) {
+      fields.insert(fields.begin(), "0");
+    }
+    if (fields.size() != 6) {
+      bad_rule("cron expression", expr);
+    }
 
-    while (*it) {
-      if (*it == '%') {
-        it = std::next(it);
-        if (*it == '%') {
-          os << *it;
-          it = std::next(it);
-          continue;
+    recurrence r;
+    bool any, dom_any, dow_any;
+    r.seconds = cron_field(fields[0], 0, 59, nullptr, 0, 0, "seconds", any);
+    r.minutes = cron_field(fields[1], 0, 59, nullptr, 0, 0, "minutes", any);
+    r.hours = cron_field(fields[2], 0, 23, nullptr, 0, 0, "hours", any);
+    std::string dom = upper(fields[3]);
+    size_t last = dom.find('L');
+    if (last != std::string::npos && (last == 0 || dom[last-1] == ',') && (last + 1 == dom.size() || dom[last+1] == ',')) {
+      r.last_days = 1u << 1;
+      dom.erase(last, last + 1 < dom.size() ? 2 : 1);
+      if (!dom.empty() && dom.back() == ',') {
+        dom.pop_back();
+      }
+    }
+    dom_any = false;
+    if (!dom.empty()) {
+      r.days = cron_field(dom, 1, 31, nullptr, 0, 0, "day of month", dom_any);
+    }
+    r.months = cron_field(fields[4], 1, 12, month_names, 12, 1, "month", any);
+    uint64_t dow = cron_field(fields[5], 0, 7, day_names, 7, 0, "day of week", dow_any);
+    r.week_days = (dow | (dow >> 7)) & 0x7f;
+    // a star for the day of the month or of the week leaves the other alone.
+    r.day_or = !dom_any && !dow_any;
+    r.check();
+    return r;
+  }
+
+  recurrence recurrence::rrule(std::string_view rule) {
+    if (rule.substr(0, 6) == "RRULE:") {
+      rule.remove_prefix(6);
+    }
+    static const char* const freqs[] = {"YEARLY", "MONTHLY", "WEEKLY", "DAILY", "HOURLY", "MINUTELY", "SECONDLY"};
+    int freq = -1;
+    recurrence r;
+    bool by_day = false;
+    split_list(rule, ';', [&](std::string_view part) {
+      if (part.empty()) {
+        return;
+      }
+      size_t eq = part.find('=');
+      if (eq == std::string_view::npos) {
+        bad_rule("rule part", part);
+      }
+      auto key = upper(part.substr(0, eq));
+      auto value = part.substr(eq+1);
+      if (key == "FREQ") {
+        auto u = upper(value);
+        freq = std::find(std::begin(freqs), std::end(freqs), u) - std::begin(freqs);
+        if (freq == 7) {
+          bad_rule("FREQ", value);
         }
-        switch (*it) {
-          case 'S':
-          os << get_seconds();
-          break;
-          case 'Y':
-          os << std::setw(4) << std::setfill('0') << y;
-          break;
-          case 'M':
-          os << std::setw(2) << std::setfill('0') << mon;
-          break;
-          case 'D':
-          os << std::setw(2) << std::setfill('0') << d;
-          break;
-          case 'j':
-          os << std::setw(3) << std::setfill('0') << yd;
-          break;
-          case 'h':
-          os << std::setw(2) << std::setfill('0') << h;
-          break;
-          case 'm':
-          os << std::setw(2) << std::setfill('0') << min;
-          break;
-          case 's':
-          os << std::setw(2) << std::setfill('0') << s;
-          break;
-          case 'f':
-          os << std::setw(3) << std::setfill('0') << get_millis();
-          break;
-          default:
-          os << "?";
-          break;
+        return;
+      }
+      if (key == "INTERVAL") {
+        if (read_value(value, 1, 1, nullptr, 0, 0, "INTERVAL") != 1) {
+          bad_rule("INTERVAL", value);
+        }
+        return;
+      }
+      if (key == "WKST") {
+        return;
+      }
+      split_list(value, ',', [&](std::string_view item) {
+        if (key == "BYMONTH") {
+          r.months |= 1u << read_value(item, 1, 12, nullptr, 0, 0, key);
+        } else if (key == "BYMONTHDAY") {
+          int d = read_value(item, -31, 31, nullptr, 0, 0, key);
+          if (d > 0) {
+            r.days |= 1u << d;
+          } else if (d < 0) {
+            r.last_days |= 1u << -d;
+          } else {
+            bad_rule(key, item);
+          }
+        } else if (key == "BYDAY") {
+          by_day = true;
+          r.week_days |= 1u << read_value(upper(item), 0, 6, rrule_days, 7, 0, key);
+        } else if (key == "BYHOUR") {
+          r.hours |= 1u << read_value(item, 0, 23, nullptr, 0, 0, key);
+        } else if (key == "BYMINUTE") {
+          r.minutes |= uint64_t(1) << read_value(item, 0, 59, nullptr, 0, 0, key);
+        } else if (key == "BYSECOND") {
+          r.seconds |= uint64_t(1) << read_value(item, 0, 59, nullptr, 0, 0, key);
+        } else {
+          bad_rule("rule part", part);
         }
+      });
+    });
+    if (freq < 0) {
+      bad_rule("rule, no FREQ", rule);
+    }
+    enum {yearly, monthly, weekly, daily, hourly, minutely, secondly};
+    // fields not given repeat at the frequency and above, and take their
+    // first value below it.
+    bool with_days = r.days || r.last_days;
+    if (!r.months) {
+      r.months = freq >= monthly || with_days || by_day ? 0x1ffe : 1u << 1;
+    }
+    if (!with_days && !by_day) {
+      if (freq == weekly) {
+        r.week_days = 1u << 1;
+        by_day = true;
+      }
+      if (freq >= weekly) {
+        r.days = ~uint32_t(0) << 1;
       } else {
-        os << *it;
+        r.days = 1u << 1;
       }
-      it = std::next(it);
     }
-    return os.str();
+    if (!with_days && by_day) {
+      r.days = ~uint32_t(0) << 1;
+    }
+    if (!by_day) {
+      r.week_days = 0x7f;
+    }
+    if (!r.hours) {
+      r.hours = freq >= hourly ? 0xffffff : 1;
+    }
+    if (!r.minutes) {
+      r.minutes = freq >= minutely ? (uint64_t(1) << 60) - 1 : 1;
+    }
+    if (!r.seconds) {
+      r.seconds = freq >= secondly ? (uint64_t(1) << 60) - 1 : 1;
+    }
+    r.day_or = false;
+    r.check();
+    return r;
   }
 
-  std::string instant::to_string() const {
-    return format();
+  // month_days gives the days of the month that match, bit d for the day d.
+  uint64_t recurrence::month_days(int year, int month) const {
+    int len = days_in_month(year, month);
+    uint64_t all = ((uint64_t(1) << len) - 1) << 1;
+    uint64_t dom = days;
+    for (uint32_t bits = last_days; bits; bits &= bits - 1) {
+      int k = __builtin_ctz(bits);
+      if (k <= len) {
+        dom |= uint64_t(1) << (len - k + 1);
+      }
+    }
+    // every 7th day starting from the 1st, moved to the first day of the
+    // month that falls on each of the week days.
+    const uint64_t weekly = (1u << 1) | (1u << 8) | (1u << 15) | (1u << 22) | (1u << 29);
+    int first = floor_mod(days_from_civil(year, month, 1) + 4, 7);
+    uint64_t dow = 0;
+    for (uint32_t bits = week_days; bits; bits &= bits - 1) {
+      int wd = __builtin_ctz(bits);
+      dow |= weekly << floor_mod(wd - first, 7);
+    }
+    return (day_or ? dom | dow : dom & dow) & all;
   }
 
-  int instant::year_day(int y, int m, int d) const {
-    int yd = year_days[m - 1] + d;
-    if (is_leap(y) && m > 2) {
-      yd++;
+  // check rejects the rules without any match: every combination of week
+  // days and leap years is seen in 28 years without a century.
+  void recurrence::check() const {
+    bool ok = seconds && minutes && hours;
+    bool found = false;
+    for (int y = 2000; ok && !found && y < 2028; y++) {
+      for (int m = 1; m <= 12 && !found; m++) {
+        found = (months >> m & 1) && month_days(y, m);
+      }
+    }
+    if (!ok || !found) {
+      throw parse_error("recurrence: the rule never matches");
     }
-    return yd;
   }
 
-  std::tuple<int, int, int> instant::split_date() const {
-    if (!timestamp) {
-      return std::make_tuple(epoch, 1, 1);
-    }
-    bool before = false;
-    long long base = get_seconds();
-    if (base < 0) {
-      base = -base;
-      before = true;
+  instant recurrence::next(civil c) const {
+    int y = c.year;
+    int mo = c.month;
+    int d = c.day;
+    int h = c.hour;
+    int mi = c.minute;
+    int s = c.second;
+    while (true) {
+      uint32_t mm = months >> mo << mo;
+      if (!mm) {
+        y++;
+        mo = __builtin_ctz(months);
+        d = 1;
+        h = mi = s = 0;
+        continue;
+      }
+      if (__builtin_ctz(mm) != mo) {
+        mo = __builtin_ctz(mm);
+        d = 1;
+        h = mi = s = 0;
+      }
+      uint64_t dm = month_days(y, mo) >> d << d;
+      if (!dm) {
+        mo++;
+        if (mo > 12) {
+          mo = 1;
+          y++;
+        }
+        d = 1;
+        h = mi = s = 0;
+        continue;
+      }
+      if (__builtin_ctzll(dm) != d) {
+        d = __builtin_ctzll(dm);
+        h = mi = s = 0;
+      }
+      uint32_t hm = h < 24 ? hours >> h << h : 0;
+      if (!hm) {
+        d++;
+        h = mi = s = 0;
+        continue;
+      }
+      if (__builtin_ctz(hm) != h) {
+        h = __builtin_ctz(hm);
+        mi = s = 0;
+      }
+      uint64_t nm = mi < 60 ? minutes >> mi << mi : 0;
+      if (!nm) {
+        h++;
+        mi = s = 0;
+        continue;
+      }
+      if (__builtin_ctzll(nm) != mi) {
+        mi = __builtin_ctzll(nm);
+        s = 0;
+      }
+      uint64_t sm = s < 60 ? seconds >> s << s : 0;
+      if (!sm) {
+        mi++;
+        s = 0;
+        continue;
+      }
+      s = __builtin_ctzll(sm);
+      return instant(y, mo, d, h, mi, s);
     }
+  }
 
-    long long d = base / secondsPerDay;
-    long long n = d / days400Years;
-    long long year = 400*n;
-    d -= days400Years * n;
+  // start_after gives the calendar fields of the first whole second after w.
+  static civil start_after(const instant &w) {
+    return w.floor(time_unit::second).add(1).fields();
+  }
 
-    n = d / days100Years;
-    n -= n >> 2;
-    year += 100 * n;
-    d -= days100Years * n;
+  instant recurrence::next_after(const instant &w) const {
+    return next(start_after(w));
+  }
 
-    n = d / days4Years;
-    year += 4 * n;
-    d -= days4Years * n;
+  void next_after(const recurrence* rules, size_t n, const instant &w, instant* out) {
+    civil c = start_after(w);
+    for (size_t i = 0; i < n; i++) {
+      out[i] = rules[i].next(c);
+    }
+  }
 
-    n = d / daysYears;
-    n -= n >> 2;
-    year += n;
-    d -= daysYears * n;
+  timer_wheel::timer_wheel(const instant &now):
+    current(now),
+    now_ms(radix_key(now)) {
+    heads.fill(nil);
+    tails.fill(nil);
+  }
 
-    if (before) {
-      year = -year - 1;
-      d = daysYears - d;
-      if (get_seconds() % secondsPerDay == 0) {
-        d++;
-      }
+  void timer_wheel::link(uint32_t i) {
+    auto& n = nodes[i];
+    n.next = nil;
+    n.prev = tails[n.slot];
+    if (n.prev == nil) {
+      heads[n.slot] = i;
+    } else {
+      nodes[n.prev].next = i;
     }
-
-    year += epoch;
-    if (is_leap(year)) {
-      if (d > 31+29-1) {
-        d--;
-      } else if (d == 31+29-1) {
-        return std::make_tuple(year, 2, 29);
-      }
+    tails[n.slot] = i;
+    if (n.slot < due) {
+      used[n.slot / slots] |= uint64_t(1) << (n.slot % slots);
     }
+  }
 
-    int leap = year % 4;
-    if (leap == 1) {
-      d--;
+  void timer_wheel::unlink(uint32_t i) {
+    auto& n = nodes[i];
+    if (n.prev == nil) {
+      heads[n.slot] = n.next;
+    } else {
+      nodes[n.prev].next = n.next;
+    }
+    if (n.next == nil) {
+      tails[n.slot] = n.prev;
+    } else {
+      nodes[n.next].prev = n.prev;
+    }
+    if (n.slot < due && heads[n.slot] == nil) {
+      used[n.slot / slots] &= ~(uint64_t(1) << (n.slot % slots));
     }
-    leap = year % 100;
-    if (leap >= 70 || leap == 0) {
-      if (year > epoch) {
-        leap = leap != 0 ? (year - leap) - 1900 : year;
+  }
+
+  // place links a node in the slot of its deadline relative to now_ms.
+  void timer_wheel::place(uint32_t i) {
+    auto& n = nodes[i];
+    uint64_t at = radix_key(n.deadline);
+    if (at <= now_ms) {
+      n.slot = due;
+    } else {
+      uint64_t diff = at ^ now_ms;
+      int level = (63 - __builtin_clzll(diff)) / bits;
+      if (level >= levels) {
+        n.slot = overflow;
       } else {
-        leap = leap != 0 ? 1900 - (year - leap) : year;
-      }
-      if (leap % 400 != 0) {
-        d--;
+        n.slot = level * slots + ((at >> (level * bits)) & (slots - 1));
       }
     }
+    link(i);
+  }
 
-    long long mon = d/31;
-    long long end = year_days[mon+1];
-    long long beg = 0;
-    if (d >= end) {
-      mon++;
-      beg = end;
+  timer_wheel::timer_id timer_wheel::schedule(const instant &deadline, uint64_t data) {
+    uint32_t i = free_list;
+    if (i == nil) {
+      i = nodes.size();
+      nodes.push_back(node{});
     } else {
-      beg = year_days[mon];
+      free_list = nodes[i].next;
     }
-    mon++;
-
-    long long day = d - beg + 1;
-    return std::make_tuple(year, mon, day);
+    auto& n = nodes[i];
+    n.deadline = deadline;
+    n.data = data;
+    place(i);
+    count++;
+    return (static_cast<uint64_t>(n.gen) << 32) | i;
   }
 
-  std::tuple<int, int, int> instant::split_time() const {
-    long long seconds = get_seconds();
-    if (seconds < 0) {
-      seconds = -seconds;
+  // release returns a node to the pool with a new generation. A node whose
+  // generation would wrap around is retired instead, so that no id is ever
+  // given twice.
+  void timer_wheel::release(uint32_t i) {
+    auto& n = nodes[i];
+    n.slot = nil;
+    count--;
+    if (++n.gen == UINT32_MAX) {
+      return;
     }
-    seconds = seconds % secondsPerDay;
-    if (!seconds) {
-      return std::make_tuple(0, 0, 0);
+    n.next = free_list;
+    free_list = i;
+  }
+
+  bool timer_wheel::cancel(timer_id id) {
+    uint32_t i = id & UINT32_MAX;
+    if (i >= nodes.size() || nodes[i].gen != (id >> 32) || nodes[i].slot == nil) {
+      return false;
     }
+    unlink(i);
+    release(i);
+    return true;
+  }
 
-    int h = seconds / secondsPerHour;
-    seconds -= h * secondsPerHour;
-    int m = seconds / secondsPerMin;
-    int s = seconds - (m * secondsPerMin);
+  // cascade moves the timers of a slot to the lower levels now that the
+  // time of the wheel reached the start of the slot.
+  void timer_wheel::cascade(uint32_t slot) {
+    uint32_t i = heads[slot];
+    heads[slot] = tails[slot] = nil;
+    if (slot < due) {
+      used[slot / slots] &= ~(uint64_t(1) << (slot % slots));
+    }
+    while (i != nil) {
+      uint32_t next = nodes[i].next;
+      place(i);
+      i = next;
+    }
+  }
 
-    if (timestamp < 0) {
-      s = s ? 60 - s : s;
-      m = 59 - m;
-      if (!s) {
-        m++;
-      }
-      h = 23 - h;
+  // fire appends the timers of a slot to out. The timers of a slot of the
+  // first level share their deadline, but the ones due were scheduled in any
+  // order and are sorted, keeping the order of scheduling on ties.
+  void timer_wheel::fire(uint32_t slot, std::vector<expired> &out) {
+    size_t first = out.size();
+    uint32_t i = heads[slot];
+    heads[slot] = tails[slot] = nil;
+    if (slot < due) {
+      used[slot / slots] &= ~(uint64_t(1) << (slot % slots));
+    }
+    while (i != nil) {
+      uint32_t next = nodes[i].next;
+      out.push_back(expired{nodes[i].deadline, nodes[i].data});
+      release(i);
+      i = next;
+    }
+    if (slot == due) {
+      std::stable_sort(out.begin() + first, out.end(), [](const expired &a, const expired &b) {
+        return a.deadline < b.deadline;
+      });
     }
-    return std::make_tuple(h, m, s);
   }
 
-  long long instant::get_seconds() const {
-    return timestamp / millis;
+  size_t timer_wheel::advance_to(const instant &w, std::vector<expired> &out) {
+    size_t before = out.size();
+    fire(due, out);
+    uint64_t target = radix_key(w);
+    while (now_ms < target) {
+      // the next time something happens is the start of the first slot
+      // used at any level, or the end of the last level for the overflow.
+      uint64_t next = UINT64_MAX;
+      for (int l = 0; l < levels; l++) {
+        if (used[l]) {
+          int shift = l * bits;
+          uint64_t lap = now_ms >> (shift + bits) << (shift + bits);
+          next = std::min(next, lap | (uint64_t(__builtin_ctzll(used[l])) << shift));
+        }
+      }
+      if (heads[overflow] != nil) {
+        next = std::min(next, ((now_ms >> (levels * bits)) + 1) << (levels * bits));
+      }
+      if (next > target) {
+        now_ms = target;
+        break;
+      }
+      now_ms = next;
+      if (next % (uint64_t(1) << (levels * bits)) == 0) {
+        cascade(overflow);
+      }
+      for (int l = levels - 1; l > 0; l--) {
+        uint32_t slot = l * slots + ((next >> (l * bits)) & (slots - 1));
+        if (next % (uint64_t(1) << (l * bits)) == 0 && heads[slot] != nil) {
+          cascade(slot);
+        }
+      }
+      fire(next & (slots - 1), out);
+      fire(due, out);
+    }
+    if (now_ms == target) {
+      current = w;
+    }
+    return out.size() - before;
   }
 
-  int instant::get_millis() const {
-    return timestamp % millis;
+  // parse_rows parses the rows [first, last) where first is a multiple of 64.
+  static size_t parse_rows(const parser &p, const std::string_view* in, size_t first, size_t last, instant* out, uint64_t* errors) {
+    size_t bad = 0;
+    for (size_t w = first; w < last; w += 64) {
+      uint64_t bits = 0;
+      size_t end = std::min(last, w + 64);
+      for (size_t i = w; i < end; i++) {
+        auto res = p.try_parse(in[i]);
+        if (res) {
+          out[i] = res.value;
+        } else {
+          out[i] = instant();
+          bits |= uint64_t(1) << (i - w);
+        }
+      }
+      errors[w / 64] = bits;
+      bad += __builtin_popcountll(bits);
+    }
+    return bad;
   }
 
-  int instant::epoch = 1970;
-  int instant::millis = 1000;
+  // parse_batch_min is the number of rows a thread should at least have.
+  static constexpr size_t parse_batch_min = 16384;
 
-  std::vector<int> instant::year_days{
-    0,
-    31,
-    31 + 28,
-    31 + 28 + 31,
-    31 + 28 + 31 + 30,
-    31 + 28 + 31 + 30 + 31,
-    31 + 28 + 31 + 30 + 31 + 30,
-    31 + 28 + 31 + 30 + 31 + 30 + 31,
-    31 + 28 + 31 + 30 + 31 + 30 + 31 + 31,
-    31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30,
-    31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30 + 31,
-    31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30 + 31 + 30,
-    31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30 + 31 + 30 + 31,
-  };
+  size_t parse_batch(const parser &p, const std::string_view* in, size_t n, instant* out, uint64_t* errors, unsigned threads) noexcept {
+    if (!threads) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    size_t per = std::max(parse_batch_min, (n + threads - 1) / threads);
+    per = (per + 63) / 64 * 64;
+    if (per >= n) {
+      return parse_rows(p, in, 0, n, out, errors);
+    }
 
-  std::vector<int> instant::month_days{
-    0,
-    31,
-    28,
-    31,
-    30,
-    31,
-    30,
-    31,
-    31,
-    30,
-    31,
-    30,
-    31,
-  };
+    size_t parts = (n + per - 1) / per;
+    std::vector<size_t> bad;
+    std::vector<std::thread> workers;
+    size_t done = 0;
+    try {
+      bad.resize(parts);
+      workers.reserve(parts - 1);
+      for (size_t i = 1; i < parts; i++) {
+        workers.emplace_back([&, i] {
+          bad[i] = parse_rows(p, in, i * per, std::min(n, (i + 1) * per), out, errors);
+        });
+        done = i;
+      }
+    } catch (const std::exception&) {
+      // rows of the threads that could not be started are parsed below.
+    }
+    if (bad.empty()) {
+      return parse_rows(p, in, 0, n, out, errors);
+    }
+    bad[0] = parse_rows(p, in, 0, per, out, errors);
+    if (done + 1 < parts) {
+      bad[0] += parse_rows(p, in, (done + 1) * per, n, out, errors);
+    }
+    for (auto& w: workers) {
+      w.join();
+    }
+    size_t total = 0;
+    for (auto b: bad) {
+      total += b;
+    }
+    return total;
+  }
 
-  std::vector<long long> instant::leap_seconds{
-    362707200, //1981-06-30T00:00:00Z
-    394243200, //1982-06-30T00:00:00Z
-    425779200, //1983-06-30T00:00:00Z
-    488937600, //1985-06-30T00:00:00Z
-    567907200, //1987-12-31T00:00:00Z
-    631065600, //1989-12-31T00:00:00Z
-    662601600, //1990-12-31T00:00:00Z
-    709862400, //1992-06-30T00:00:00Z
-    741398400, //1993-06-30T00:00:00Z
-    772934400, //1994-06-30T00:00:00Z
-    820368000, //1995-12-31T00:00:00Z
-    867628800, //1997-06-30T00:00:00Z
-    915062400, //1998-12-31T00:00:00Z
-    1135987200, //2005-12-31T00:00:00Z
-    1230681600, //2008-12-31T00:00:00Z
-    1341014400, //2012-06-30T00:00:00Z
-    1435622400, //2015-06-30T00:00:00Z
-    1483142400, //2016-12-31T00:00:00Z
-  };
+  size_t parse_batch(std::string_view pattern, const std::string_view* in, size_t n, instant* out, uint64_t* errors, unsigned threads) noexcept {
+    try {
+      parser p(pattern);
+      return parse_batch(p, in, n, out, errors, threads);
+    } catch (const std::exception&) {
+      for (size_t i = 0; i < n; i++) {
+        out[i] = instant();
+      }
+      for (size_t w = 0; w < n; w += 64) {
+        errors[w / 64] = n - w >= 64 ? ~uint64_t(0) : (uint64_t(1) << (n - w)) - 1;
+      }
+      return n;
+    }
+  }
 }
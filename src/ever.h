@@ -5,14 +5,157 @@
 #include <exception>
 #include <vector>
 #include <tuple>
+#include <string>
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <initializer_list>
+#include <utility>
+#include <algorithm>
+#include <iterator>
 
 namespace ever {
 
-  bool is_leap(int year);
+  constexpr unsigned days400Years = (365 * 400) + 97;
+  // days between 0000-03-01 and 1970-01-01
+  constexpr unsigned daysToEpoch = 719468;
+
+  constexpr unsigned secondsPerMin = 60;
+  constexpr unsigned secondsPerHour = 60*60;
+  constexpr unsigned secondsPerDay = 60*60*24;
+  constexpr unsigned secondsPerWeek = secondsPerDay*7;
+
+  constexpr bool is_leap(int year) {
+    return year % 400 == 0 || (year % 4 == 0 && year % 100 != 0);
+  }
+
+  constexpr int days_in_month(int year, int month) {
+    // months with 31 days are the odd ones until july and the even ones after
+    return month == 2 ? 28 + is_leap(year) : 30 + ((month + (month >> 3)) & 1);
+  }
+
+  // floor_div and floor_mod round toward negative infinity where / and %
+  // truncate toward zero.
+  constexpr long long floor_div(long long v, long long d) {
+    return (v - (v < 0) * (d - 1)) / d;
+  }
+
+  constexpr long long floor_mod(long long v, long long d) {
+    return v - floor_div(v, d) * d;
+  }
+
+  // days_from_civil and civil_from_days convert between a date of the
+  // proleptic gregorian calendar and the number of days since 1970-01-01.
+  // Years are counted from the 1st of march so that the leap day is the last
+  // day of the year and the length of the months (starting at march) follows
+  // the pattern given by (153*m+2)/5.
+  constexpr long long days_from_civil(long long y, int m, int d) {
+    y -= m <= 2;
+    long long era = floor_div(y, 400);
+    long long yoe = y - era * 400;
+    long long doy = (153 * ((m + 9) % 12) + 2) / 5 + d - 1;
+    long long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * days400Years + doe - daysToEpoch;
+  }
+
+  constexpr std::tuple<int, int, int> civil_from_days(long long z) {
+    z += daysToEpoch;
+    long long era = floor_div(z, days400Years);
+    long long doe = z - era * days400Years;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long mp = (5 * doy + 2) / 153;
+    int d = doy - (153 * mp + 2) / 5 + 1;
+    int m = mp + 3 - 12 * (mp >= 10);
+    return std::tuple<int, int, int>(yoe + era * 400 + (m <= 2), m, d);
+  }
+
+  // time_unit is the size of the buckets used by instant::floor and ceil.
+  // Weeks start on sunday, the first day of instant::week_day.
+  enum class time_unit {second, minute, hour, day, week, month, year};
+
+  // bucket_start gives the start of the bucket of unit u containing ms and
+  // bucket_next the start of the bucket following the one starting at start,
+  // both in milliseconds since the epoch.
+  constexpr long long bucket_start(long long ms, time_unit u) {
+    constexpr long long msPerDay = secondsPerDay * 1000;
+    switch (u) {
+      case time_unit::second:
+      return floor_div(ms, 1000) * 1000;
+      case time_unit::minute:
+      return floor_div(ms, secondsPerMin * 1000) * secondsPerMin * 1000;
+      case time_unit::hour:
+      return floor_div(ms, secondsPerHour * 1000) * secondsPerHour * 1000;
+      case time_unit::day:
+      return floor_div(ms, msPerDay) * msPerDay;
+      case time_unit::week: {
+        // 1st january of 1970 was a thursday, the first sunday was the 4th.
+        long long sunday = 3 * msPerDay;
+        return floor_div(ms - sunday, 7 * msPerDay) * 7 * msPerDay + sunday;
+      }
+      case time_unit::month:
+      case time_unit::year: {
+        long long days = floor_div(ms, msPerDay);
+        auto [y, m, d] = civil_from_days(days);
+        days -= d - 1;
+        if (u == time_unit::year) {
+          days = days_from_civil(y, 1, 1);
+        }
+        return days * msPerDay;
+      }
+    }
+    return ms;
+  }
+
+  constexpr long long bucket_next(long long start, time_unit u) {
+    constexpr long long msPerDay = secondsPerDay * 1000;
+    switch (u) {
+      case time_unit::second:
+      return start + 1000;
+      case time_unit::minute:
+      return start + secondsPerMin * 1000;
+      case time_unit::hour:
+      return start + secondsPerHour * 1000;
+      case time_unit::day:
+      return start + msPerDay;
+      case time_unit::week:
+      return start + 7 * msPerDay;
+      case time_unit::month: {
+        auto [y, m, d] = civil_from_days(floor_div(start, msPerDay));
+        return days_from_civil(y + (m == 12), m % 12 + 1, d) * msPerDay;
+      }
+      case time_unit::year: {
+        auto [y, m, d] = civil_from_days(floor_div(start, msPerDay));
+        return days_from_civil(y + 1, m, d) * msPerDay;
+      }
+    }
+    return start;
+  }
+
+  enum class parse_errc {
+    none,
+    unexpected_character,
+    unexpected_end,
+    trailing_input,
+    unknown_specifier,
+    year_day_conflict,
+    invalid_month,
+    invalid_day,
+    invalid_year_day,
+    invalid_hour,
+    invalid_minute,
+    invalid_second,
+    invalid_month_day,
+  };
+
+  const char* describe(parse_errc err);
 
   class parse_error: public std::exception {
   public:
     parse_error(std::string m): msg(m) {}
+    parse_error(parse_errc e, size_t o): msg(describe(e)), err(e), off(o) {}
     virtual ~parse_error() {}
 
     virtual const char* what() const throw() {
@@ -21,89 +164,1456 @@ namespace ever {
       }
       return msg.c_str();
     }
+
+    parse_errc code() const { return err; }
+    size_t offset() const { return off; }
   private:
     std::string msg;
+    parse_errc err = parse_errc::none;
+    size_t off = 0;
+  };
+
+  struct parse_result;
+  struct civil_columns;
+
+  // civil holds all the broken down fields of an instant. It is filled in one
+  // pass by instant::fields.
+  struct civil {
+    int year;
+    int month;
+    int day;
+    int year_day;
+    int week_day;
+    int hour;
+    int minute;
+    int second;
+    int millis;
   };
 
   class instant {
   public:
 
+    // now reads CLOCK_REALTIME with a millisecond precision. now_coarse
+    // reads CLOCK_REALTIME_COARSE when available: it is cheaper but only
+    // updated at each tick of the kernel (a few milliseconds).
     static instant now();
-    static instant parse(std::string pattern, std::string str);
-
-    instant();
-    instant(long long w, int ms = 0);
-    instant(int year, int mon, int day, int hour=0, int min=0, int sec=0);
-    instant(const instant &w);
-
-    bool operator==(const instant &w) const;
-    bool operator!=(const instant &w) const;
-    bool operator<(const instant &w) const;
-    bool operator<=(const instant &w) const;
-    bool operator>(const instant &w) const;
-    bool operator>=(const instant &w) const;
-    instant operator+(int w) const;
-    instant operator+=(int w) const;
-    instant operator-(int w) const;
-    instant operator-=(int w) const;
-    instant operator-() const;
-
-    long long unix() const;
-    std::tuple<int,int,int> date() const;
-    std::tuple<int,int,int> time() const;
-
-    int year() const;
-    int year_day() const;
-    int month() const;
-    int month_day() const;
-    int week_day() const;
-    int iso_week_day() const;
-    int hour() const;
-    int minutes() const;
-    int seconds() const;
-
-    double jd() const;
-    double mjd() const;
-
-    long long diff(const instant &w) const;
-    long long diff_millis(const instant &w) const;
-    instant add(int sec) const;
-    instant add(int year, int mon, int day) const;
-
-    bool is_zero();
-    bool is_before(const instant &w) const;
-    bool is_after(const instant &w) const;
-    bool equal(const instant &w) const;
-
-    // instant to_unix() const;
+    static instant now_coarse();
+    static instant parse(std::string_view pattern, std::string_view str);
+    static parse_result try_parse(std::string_view pattern, std::string_view str) noexcept;
+    static instant parse_iso(std::string_view str);
+    static parse_result try_parse_iso(std::string_view str) noexcept;
+
+    constexpr instant();
+    constexpr instant(long long w, int ms = 0);
+    constexpr instant(int year, int mon, int day, int hour=0, int min=0, int sec=0);
+    constexpr instant(const instant &w) = default;
+    constexpr instant& operator=(const instant &w) = default;
+
+    constexpr bool operator==(const instant &w) const;
+    constexpr bool operator!=(const instant &w) const;
+    constexpr bool operator<(const instant &w) const;
+    constexpr bool operator<=(const instant &w) const;
+    constexpr bool operator>(const instant &w) const;
+    constexpr bool operator>=(const instant &w) const;
+    constexpr instant operator+(int w) const;
+    constexpr instant operator+=(int w) const;
+    constexpr instant operator-(int w) const;
+    constexpr instant operator-=(int w) const;
+    constexpr instant operator-() const;
+
+    constexpr long long unix() const;
+    constexpr std::tuple<int,int,int> date() const;
+    constexpr std::tuple<int,int,int> time() const;
+    constexpr civil fields() const;
+
+    constexpr int year() const;
+    constexpr int year_day() const;
+    constexpr int month() const;
+    constexpr int month_day() const;
+    constexpr int week_day() const;
+    constexpr int iso_week_day() const;
+    constexpr int hour() const;
+    constexpr int minutes() const;
+    constexpr int seconds() const;
+
+    constexpr double jd() const;
+    constexpr double mjd() const;
+
+    constexpr long long diff(const instant &w) const;
+    constexpr long long diff_millis(const instant &w) const;
+    constexpr instant add(int sec) const;
+    constexpr instant add(int year, int mon, int day) const;
+
+    // floor gives the start of the bucket of the given unit that contains
+    // the instant, ceil the first start of a bucket not before the instant.
+    constexpr instant floor(time_unit u) const;
+    constexpr instant ceil(time_unit u) const;
+
+    constexpr bool is_zero() const;
+    constexpr bool is_before(const instant &w) const;
+    constexpr bool is_after(const instant &w) const;
+    constexpr bool equal(const instant &w) const;
+
+    // conversions between time scales: unix (UTC), GPS and TAI. GPS and TAI
+    // do not have leap seconds and are ahead of UTC by the number of leap
+    // seconds inserted since 1980 (plus 19 seconds for TAI).
+    instant to_unix() const;
     instant to_gps() const;
+    instant to_tai() const;
+
+    // diff_leap is like diff but counts the leap seconds inserted between
+    // the two instants.
+    long long diff_leap(const instant &w) const;
 
     std::string format(std::string pattern = "%Y-%M-%D %h:%m:%s.%f") const;
     std::string to_string() const;
 
   private:
-    enum class epoch_t {unix, gps};
+    friend class formatter;
+    friend class parser;
+    friend class stream_formatter;
+    friend void split_batch(const instant* first, size_t n, const civil_columns &out);
+    friend void to_unix(const instant* first, size_t n, instant* out);
+    friend void to_gps(const instant* first, size_t n, instant* out);
+    friend void to_tai(const instant* first, size_t n, instant* out);
+    friend void floor_batch(const instant* first, size_t n, time_unit u, instant* out);
+    friend void ceil_batch(const instant* first, size_t n, time_unit u, instant* out);
+    friend void add_batch(const instant* first, size_t n, int years, int months, int days, instant* out);
+    friend class leap_table;
+    friend class instant_column;
+    friend class instant_range;
+
+    enum class epoch_t : unsigned char {unix, gps, tai};
+
+    // seconds between TAI and GPS
+    static constexpr int tai_offset = 19;
+
+    static constexpr int epoch = 1970;
+    static constexpr int millis = 1000;
+
+    static constexpr int year_days[] = {
+      0,
+      31,
+      31 + 28,
+      31 + 28 + 31,
+      31 + 28 + 31 + 30,
+      31 + 28 + 31 + 30 + 31,
+      31 + 28 + 31 + 30 + 31 + 30,
+      31 + 28 + 31 + 30 + 31 + 30 + 31,
+      31 + 28 + 31 + 30 + 31 + 30 + 31 + 31,
+      31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30,
+      31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30 + 31,
+      31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30 + 31 + 30,
+      31 + 28 + 31 + 30 + 31 + 30 + 31 + 31 + 30 + 31 + 30 + 31,
+    };
+
+    static constexpr int month_days[] = {
+      0,
+      31,
+      28,
+      31,
+      30,
+      31,
+      30,
+      31,
+      31,
+      30,
+      31,
+      30,
+      31,
+    };
+
+    // instants right after each leap second, see leap_table for the list
+    // used by the conversions.
+    static constexpr long long leap_seconds[] = {
+      362793600, //1981-07-01T00:00:00Z
+      394329600, //1982-07-01T00:00:00Z
+      425865600, //1983-07-01T00:00:00Z
+      489024000, //1985-07-01T00:00:00Z
+      567993600, //1988-01-01T00:00:00Z
+      631152000, //1990-01-01T00:00:00Z
+      662688000, //1991-01-01T00:00:00Z
+      709948800, //1992-07-01T00:00:00Z
+      741484800, //1993-07-01T00:00:00Z
+      773020800, //1994-07-01T00:00:00Z
+      820454400, //1996-01-01T00:00:00Z
+      867715200, //1997-07-01T00:00:00Z
+      915148800, //1999-01-01T00:00:00Z
+      1136073600, //2006-01-01T00:00:00Z
+      1230768000, //2009-01-01T00:00:00Z
+      1341100800, //2012-07-01T00:00:00Z
+      1435708800, //2015-07-01T00:00:00Z
+      1483228800, //2017-01-01T00:00:00Z
+    };
+
+    // milliseconds since the epoch and the time scale share 8 bytes: 62 bits
+    // are enough for more than 70 million years.
+    long long timestamp : 62;
+    epoch_t zero : 2;
+
+    constexpr int get_millis() const;
+    constexpr long long get_seconds() const;
+
+    constexpr std::tuple<int, int, int> split_date() const;
+    constexpr std::tuple<int, int, int> split_time() const;
+
+  };
+
+  constexpr instant::instant(): timestamp(0), zero(epoch_t::unix) {}
+
+  constexpr instant::instant(long long w, int ms): timestamp(w*millis + ms), zero(epoch_t::unix) {}
+
+  constexpr instant::instant(int year, int mon, int day, int hour, int min, int sec): timestamp(0), zero(epoch_t::unix) {
+    long long y = year + floor_div(mon - 1, 12);
+    int m = floor_mod(mon - 1, 12) + 1;
+
+    long long seconds = days_from_civil(y, m, 1) + day - 1;
+    seconds *= secondsPerDay;
+    seconds += static_cast<long long>(hour) * secondsPerHour;
+    seconds += static_cast<long long>(min) * secondsPerMin;
+    seconds += sec;
+    timestamp = seconds * millis;
+  }
+
+  constexpr bool instant::operator==(const instant &w) const {
+    return equal(w);
+  }
+
+  constexpr bool instant::operator!=(const instant &w) const {
+    return !equal(w);
+  }
+
+  constexpr bool instant::operator<(const instant &w) const {
+    return is_before(w);
+  }
+
+  constexpr bool instant::operator<=(const instant &w) const {
+    return is_before(w) || equal(w);
+  }
+
+  constexpr bool instant::operator>(const instant &w) const {
+    return is_after(w);
+  }
+
+  constexpr bool instant::operator>=(const instant &w) const {
+    return is_after(w) || equal(w);
+  }
+
+  constexpr instant instant::operator-() const {
+    return instant{-timestamp};
+  }
+
+  constexpr instant instant::operator+(int w) const {
+    return add(w);
+  }
+
+  constexpr instant instant::operator+=(int w) const {
+    return add(w);
+  }
+
+  constexpr instant instant::operator-(int w)  const {
+    return add(-w);
+  }
+
+  constexpr instant instant::operator-=(int w)  const {
+    return add(-w);
+  }
+
+  constexpr long long instant::unix() const {
+    return get_seconds();
+  }
+
+  constexpr std::tuple<int,int,int> instant::date() const {
+    return split_date();
+  }
+
+  constexpr std::tuple<int,int,int> instant::time() const {
+    return split_time();
+  }
+
+  // fields splits the timestamp once into days and milliseconds of the day,
+  // and derives every field from these two values.
+  constexpr civil instant::fields() const {
+    constexpr long long msPerDay = secondsPerDay * millis;
+    long long days = floor_div(timestamp, msPerDay);
+    int tod = timestamp - days * msPerDay;
+    civil c{};
+    auto [y, m, d] = civil_from_days(days);
+    c.year = y;
+    c.month = m;
+    c.day = d;
+    c.year_day = days - days_from_civil(c.year, 1, 1) + 1;
+    // 1st january of 1970 was a thursday (5th day of the week)
+    c.week_day = floor_mod(days + 5, 7);
+    c.millis = tod % millis;
+    int seconds = tod / millis;
+    c.hour = seconds / secondsPerHour;
+    seconds -= c.hour * secondsPerHour;
+    c.minute = seconds / secondsPerMin;
+    c.second = seconds - c.minute * secondsPerMin;
+    return c;
+  }
+
+  constexpr int instant::year() const {
+    return std::get<0>(split_date());
+  }
+
+  constexpr int instant::year_day() const {
+    return fields().year_day;
+  }
+
+  constexpr int instant::month() const {
+    return std::get<1>(split_date());
+  }
+
+  constexpr int instant::month_day() const {
+    return std::get<2>(split_date());
+  }
+
+  constexpr int instant::week_day() const {
+    // 1st january of 1970 was a thursday (5th day of the week)
+    return floor_mod(get_seconds() + (5*secondsPerDay), secondsPerWeek) / secondsPerDay;
+  }
+
+  constexpr int instant::iso_week_day() const {
+    return week_day()-1;
+  }
+
+  constexpr int instant::hour() const {
+    return std::get<0>(split_time());
+  }
+
+  constexpr int instant::minutes() const {
+    return std::get<1>(split_time());
+  }
+
+  constexpr int instant::seconds() const {
+    return std::get<2>(split_time());
+  }
+
+  constexpr double instant::jd() const {
+    auto c = fields();
+    int y = c.year;
+    int m = c.month;
+
+    int day = (1461 * (y + 4800 + (m - 14) / 12)) / 4;
+    day += (367 * (m - 2 - 12 * ((m - 14) / 12))) / 12;
+    day -= (3 * ((y + 4900 + (m - 14) / 12) / 100)) / 4;
+    day += c.day - 32075;
+
+    double frac = ((((c.second / 60.0) + c.minute) / 60.0) + c.hour) / 24.0;
+
+    return day+frac-0.5;
+  }
+
+  constexpr double instant::mjd() const {
+    return jd() - 2400000.5;
+  }
+
+  constexpr long long instant::diff(const instant &w) const {
+    return get_seconds() - w.get_seconds();
+  }
+
+  constexpr long long instant::diff_millis(const instant &w) const {
+    return timestamp - w.timestamp;
+  }
+
+  constexpr instant instant::add(int sec) const {
+    return instant(get_seconds()+sec, get_millis());
+  }
+
+  // add moves the date by y years and m months, then by d days, with no loop:
+  // the month is normalized with a floor division and days beyond the end
+  // of the month roll over to the next one. The time of day is kept.
+  constexpr instant instant::add(int y, int m, int d) const {
+    long long msPerDay = secondsPerDay * millis;
+    long long days = floor_div(timestamp, msPerDay);
+    auto [year, mon, day] = civil_from_days(days);
+    long long mm = mon - 1 + static_cast<long long>(m);
+    long long yy = year + static_cast<long long>(y) + floor_div(mm, 12);
+    days = days_from_civil(yy, floor_mod(mm, 12) + 1, 1) + day - 1 + d;
+
+    instant w(*this);
+    w.timestamp = days * msPerDay + floor_mod(timestamp, msPerDay);
+    return w;
+  }
+
+  constexpr instant instant::floor(time_unit u) const {
+    instant w(*this);
+    w.timestamp = bucket_start(timestamp, u);
+    return w;
+  }
+
+  constexpr instant instant::ceil(time_unit u) const {
+    instant w(*this);
+    long long start = bucket_start(timestamp, u);
+    w.timestamp = start == timestamp ? start : bucket_next(start, u);
+    return w;
+  }
+
+  constexpr bool instant::is_before(const instant &w) const {
+    return timestamp < w.timestamp;
+  }
+
+  constexpr bool instant::is_after(const instant &w) const {
+    return timestamp > w.timestamp;
+  }
+
+  constexpr bool instant::equal(const instant &w) const {
+    return timestamp == w.timestamp;
+  }
+
+  constexpr bool instant::is_zero() const {
+    return timestamp == 0;
+  }
+
+  constexpr std::tuple<int, int, int> instant::split_date() const {
+    return civil_from_days(floor_div(get_seconds(), secondsPerDay));
+  }
+
+  constexpr std::tuple<int, int, int> instant::split_time() const {
+    int seconds = floor_mod(get_seconds(), secondsPerDay);
+    int h = seconds / secondsPerHour;
+    seconds -= h * secondsPerHour;
+    int m = seconds / secondsPerMin;
+    int s = seconds - (m * secondsPerMin);
+    return std::tuple<int, int, int>(h, m, s);
+  }
+
+  constexpr long long instant::get_seconds() const {
+    return floor_div(timestamp, millis);
+  }
+
+  constexpr int instant::get_millis() const {
+    return floor_mod(timestamp, millis);
+  }
+
+  // formatter compiles a pattern once (see instant::format for the list of
+  // specifiers) into a list of literals and fixed width fields that can be
+  // applied to any number of instants without rescanning the pattern.
+  class formatter {
+  public:
+    formatter(std::string pattern = "%Y-%M-%D %h:%m:%s.%f");
+
+    // write at most len characters of the formatted instant into buf (no
+    // terminating NUL is added) and return the length of the complete output.
+    size_t format_to(char* buf, size_t len, const instant &w) const;
+    std::string format(const instant &w) const;
+
+  private:
+    enum class field_t {literal, unix, year, month, day, year_day, hour, minute, second, millis};
+
+    struct op {
+      field_t field;
+      int width;
+      size_t offset;
+      size_t length;
+    };
+
+    std::string literals;
+    std::vector<op> ops;
+    bool with_date = false;
+    bool with_time = false;
+
+    void push_literal(const char* str, size_t len);
+    void push_field(field_t field, int width);
+
+    friend class stream_formatter;
+    // render is format_to that also gives the offset in buf where the output
+    // of each op starts when offsets is not null.
+    size_t render(char* buf, size_t len, const instant &w, size_t* offsets) const;
+  };
+
+  // stream_formatter formats instants that are given in (nearly) sorted
+  // order. It keeps the text of the last instant and only rewrites the fields
+  // of the time of day that changed while the day stays the same. Everything
+  // is formatted again when the day changes or with %S when the second changes.
+  // The returned text is valid until the next call.
+  class stream_formatter {
+  public:
+    stream_formatter(std::string pattern = "%Y-%M-%D %h:%m:%s.%f");
+
+    std::string_view format(const instant &w);
+    void reset();
+
+  private:
+    formatter fmt;
+    std::string text;
+    std::vector<size_t> offsets;
+    bool with_unix;
+    long long day;
+    long long second;
+    int millis;
+
+    void render(const instant &w);
+  };
+
+  // time_cache is a stream_formatter fed with the current time, in the way of
+  // the cached time of nginx: the text is only formatted again when the second
+  // changes, else only the digits of the milliseconds are rewritten. A
+  // time_cache is not thread safe: use one per thread, local() gives one with
+  // the default pattern.
+  class time_cache {
+  public:
+    time_cache(std::string pattern = "%Y-%M-%D %h:%m:%s.%f", bool coarse = false);
+
+    static time_cache& local();
+
+    // stamp returns the formatted text of the current time or of w. The text
+    // is valid until the next call.
+    std::string_view stamp();
+    std::string_view stamp(const instant &w);
+
+  private:
+    stream_formatter fmt;
+    bool coarse;
+  };
+
+  // fast_clock reads the time from the cycle counter of the CPU (TSC). It is
+  // calibrated against CLOCK_MONOTONIC at the first call, anchored on
+  // CLOCK_REALTIME and calibrated again about every second. When the TSC is
+  // not invariant or its rate drifts, fast_clock falls back to clock_gettime.
+  // Values can step back by a few microseconds when the clock is anchored again.
+  class fast_clock {
+  public:
+    static instant now();
+    // now_nanos gives the number of nanoseconds since the unix epoch.
+    static long long now_nanos();
+    static bool uses_tsc();
+  };
+
+  struct parse_result {
+    instant value;
+    parse_errc error = parse_errc::none;
+    size_t offset = 0;
+
+    constexpr explicit operator bool() const { return error == parse_errc::none; }
+  };
+
+  // parser compiles a pattern once (see instant::parse for the list of
+  // specifiers) and parses any number of input strings with it. Errors in the
+  // pattern are reported by the constructor.
+  class parser {
+  public:
+    parser(std::string_view pattern);
+
+    instant parse(std::string_view str) const;
+    instant parse(const char* first, const char* last) const;
+
+    parse_result try_parse(std::string_view str) const noexcept;
+    parse_result try_parse(const char* first, const char* last) const noexcept;
+
+    // try_parse_prefix parses the start of the input and ignores what follows
+    // the pattern. On success, offset is the number of characters consumed.
+    parse_result try_parse_prefix(const char* first, const char* last) const noexcept;
+
+  private:
+    friend class instant;
+    friend class multi_parser;
+
+    enum class field_t {literal, year, month, day, year_day, hour, minute, second, millis};
+
+    struct op {
+      field_t field;
+      int width;
+      size_t offset;
+      size_t length;
+    };
+
+    struct compile_state {
+      bool with_yday = false;
+      bool with_mday = false;
+    };
+
+    struct fields {
+      int year = 0;
+      int yday = -1;
+      int month = -1;
+      int day = -1;
+      int hour = 0;
+      int minute = 0;
+      int second = 0;
+      int millis = 0;
+      size_t day_offset = 0;
+    };
+
+    std::string pattern;
+    std::vector<op> ops;
+    // length of the input when the pattern is one of the fixed layouts
+    // handled by instant::try_parse_iso, 0 otherwise.
+    size_t iso_length = 0;
+
+    static parse_errc next_op(std::string_view pattern, size_t &pos, compile_state &cs, op &o) noexcept;
+    static parse_errc apply_op(const op &o, const char* pattern, const char* first, const char* &in, const char* last, fields &f) noexcept;
+    static parse_errc set_field(field_t field, int v, size_t offset, fields &f) noexcept;
+    static parse_errc make_instant(fields &f, instant &w) noexcept;
+  };
+
+  // multi_parser accepts several patterns at once. The patterns are merged
+  // into a deterministic automaton over the characters of the input that
+  // reads the fields of every pattern still possible as it goes, so one pass
+  // finds which pattern matches and its fields; they are only checked at the
+  // end. When several patterns match, the first one given wins. So that
+  // streams of timestamps with the same layout skip the automaton, a pattern
+  // that matched twice in a row is tried first with its own parser, unless
+  // an earlier pattern accepts inputs of the same shape. Up to 64 patterns
+  // are supported.
+  class multi_parser {
+  public:
+    multi_parser(std::initializer_list<std::string_view> patterns);
+    multi_parser(const std::vector<std::string> &patterns);
+
+    // which, when not null, receives the index of the pattern that matched.
+    instant parse(std::string_view str, size_t* which = nullptr) const;
+    parse_result try_parse(std::string_view str, size_t* which = nullptr) const noexcept;
+
+    size_t size() const { return parsers.size(); }
+
+  private:
+    std::vector<parser> parsers;
+    // classes maps each character to its class: 0 for characters that appear
+    // in no pattern, 1 for the digits that are not literals, and one class per
+    // literal character.
+    std::array<unsigned char, 256> classes{};
+    size_t num_classes = 0;
+    // transitions has num_classes entries per state, -1 for no transition.
+    std::vector<int> transitions;
+    // accept has one bit per pattern that matches at the end of each state.
+    std::vector<uint64_t> accept;
+    // The digits of the fields are accumulated into registers while walking
+    // the automaton. Patterns that agree up to the end of a field read it
+    // from the same characters, so they share its register. A year takes two
+    // registers, the second one for its sign.
+    static constexpr size_t max_registers = 512;
+    enum class step : unsigned char {add, set, set_year, set_negative_year};
+    struct action {
+      uint16_t reg;
+      step op;
+    };
+    // the actions of transition t are actions[action_first[t]] to
+    // actions[action_first[t+1]-1].
+    std::vector<action> actions;
+    std::vector<uint32_t> action_first;
+    // registers has the register of each op of each pattern.
+    std::vector<std::vector<uint16_t>> registers;
+    // cacheable has one bit per pattern that can be tried before the
+    // automaton: no earlier pattern shares an accepting state with it.
+    uint64_t cacheable = 0;
+    mutable std::atomic<size_t> last{0};
+
+    void compile();
+    parse_result finish(size_t k, const int* values) const noexcept;
+  };
+
+  // line_range is a range of byte offsets [first, last) in a text.
+  struct line_range {
+    size_t first;
+    size_t last;
+  };
+
+  // search_lines finds the lines of text whose timestamp is in [from, to) by
+  // binary search over the byte offsets. The timestamp of each line starts
+  // column bytes after the beginning of the line and is read with p. Lines
+  // must be sorted by time; lines without a valid timestamp (continuations of
+  // a message) are kept with the line before them. Each probe only reads from
+  // its offset to the start of the next line with a timestamp.
+  line_range search_lines(std::string_view text, const parser &p, size_t column, const instant &from, const instant &to);
+  size_t search_lines(std::string_view text, const parser &p, size_t column, const instant &w);
+
+  // leap_table is an immutable list of leap seconds with their offsets in
+  // both the UTC and the GPS scales. The conversions between time scales use
+  // the table given by current(): the list compiled in the library until a
+  // new table is installed. Readers never lock: installing a table only
+  // swaps an atomic pointer and the previous tables are kept alive (they
+  // are small and replaced a few times a year at most).
+  class leap_table {
+  public:
+    // bucket is the range of seconds, in the UTC or in the GPS scale,
+    // between two leap seconds and the number of leap seconds before it.
+    struct bucket {
+      long long lo = 1;
+      long long hi = 0;
+      int count = 0;
+
+      bool contains(long long secs) const { return secs >= lo && secs < hi; }
+    };
+
+    static const leap_table& current();
+    static void install(leap_table t);
+
+    static leap_table builtin();
+    // parse reads the leap-seconds.list file published by the IERS or the
+    // leapseconds file of the tz database. Leap seconds before the GPS
+    // epoch are skipped.
+    static leap_table parse(std::istream &in);
+    static leap_table load(const std::string &file);
+
+    size_t size() const;
+    // expires returns the time (in seconds since the epoch) after which the
+    // list should be updated or 0 when the file does not say.
+    long long expires() const;
+
+    bucket utc_bucket(long long secs) const;
+    bucket gps_bucket(long long secs) const;
+
+  private:
+    leap_table() = default;
+
+    void push(long long utc, int offset);
+
+    std::vector<long long> utc;
+    std::vector<long long> gps;
+    std::vector<int> offsets;
+    long long expiry = 0;
+  };
+
+  // to_unix, to_gps and to_tai convert n instants at once. Consecutive
+  // instants between the same two leap seconds share the same lookup.
+  void to_unix(const instant* first, size_t n, instant* out);
+  void to_gps(const instant* first, size_t n, instant* out);
+  void to_tai(const instant* first, size_t n, instant* out);
+
+  // civil_columns receives the calendar fields computed by split_batch as a
+  // struct of arrays. Each array should have room for all the input values.
+  struct civil_columns {
+    int* year;
+    int* month;
+    int* day;
+    int* hour;
+    int* minute;
+    int* second;
+  };
+
+  // split_batch converts n timestamps, given as milliseconds since the epoch
+  // or as instants, to calendar fields. The results are the same as the ones
+  // of date() and time(). The conversion uses AVX2 or SSE4.1 when the CPU
+  // supports them.
+  void split_batch(const long long* millis, size_t n, const civil_columns &out);
+  void split_batch(const instant* first, size_t n, const civil_columns &out);
+
+  // parse_batch parses n strings with p into out and never throws. errors is
+  // a bitmap of (n+63)/64 words: the bit i%64 of errors[i/64] is set when
+  // in[i] is not valid and out[i] is then the zero instant. Large inputs are
+  // split across threads (all the cores when threads is 0) on boundaries of
+  // 64 rows so that no two threads write the same word. It returns the number
+  // of invalid strings. With an invalid pattern, every row is invalid.
+  size_t parse_batch(const parser &p, const std::string_view* in, size_t n, instant* out, uint64_t* errors, unsigned threads = 0) noexcept;
+  size_t parse_batch(std::string_view pattern, const std::string_view* in, size_t n, instant* out, uint64_t* errors, unsigned threads = 0) noexcept;
+
+  // floor_batch and ceil_batch store first[i].floor(u) or ceil(u) in out[i],
+  // with the instants given as milliseconds since the epoch or as instants.
+  // Units up to the week use AVX2 when the CPU supports it. Months and years
+  // reuse the last bucket while the instants stay in it, which is the common
+  // case of sorted input.
+  void floor_batch(const long long* millis, size_t n, time_unit u, long long* out);
+  void ceil_batch(const long long* millis, size_t n, time_unit u, long long* out);
+  void floor_batch(const instant* first, size_t n, time_unit u, instant* out);
+  void ceil_batch(const instant* first, size_t n, time_unit u, instant* out);
+
+  // add_batch stores first[i].add(years, months, days) in out[i]. Without
+  // years and months, it is a plain addition. Otherwise the shift of the
+  // date only depends on the day, so it is computed again only when the
+  // day changes from one instant to the next.
+  void add_batch(const instant* first, size_t n, int years, int months, int days, instant* out);
+
+  // radix_key maps an instant to an unsigned key in the same order.
+  constexpr uint64_t radix_key(const instant &w) {
+    return static_cast<uint64_t>(w.diff_millis(instant())) ^ (uint64_t(1) << 63);
+  }
+
+  // radix_sort sorts n values by the unsigned key given by key(v) with a
+  // stable LSD radix sort on the bytes of the keys. Bytes that are the same
+  // for all the keys are skipped, so that timestamps close to each other only
+  // take a few passes.
+  template <typename T, typename Key>
+  void radix_sort(T* first, size_t n, Key key) {
+    if (n < 256) {
+      std::stable_sort(first, first + n, [&](const T &a, const T &b) { return key(a) < key(b); });
+      return;
+    }
+    std::vector<size_t> counts(8 * 256);
+    for (size_t i = 0; i < n; i++) {
+      uint64_t k = key(first[i]);
+      for (int b = 0; b < 8; b++) {
+        counts[b * 256 + ((k >> (8 * b)) & 255)]++;
+      }
+    }
+    std::vector<T> tmp(n);
+    T* src = first;
+    T* dst = tmp.data();
+    for (int b = 0; b < 8; b++) {
+      size_t* c = &counts[b * 256];
+      if (c[(key(src[0]) >> (8 * b)) & 255] == n) {
+        continue;
+      }
+      size_t sum = 0;
+      for (int i = 0; i < 256; i++) {
+        size_t z = c[i];
+        c[i] = sum;
+        sum += z;
+      }
+      for (size_t i = 0; i < n; i++) {
+        dst[c[(key(src[i]) >> (8 * b)) & 255]++] = src[i];
+      }
+      std::swap(src, dst);
+    }
+    if (src != first) {
+      std::copy(src, src + n, first);
+    }
+  }
+
+  // sort_by sorts records by the instant given by get(record).
+  template <typename T, typename Get>
+  void sort_by(T* first, size_t n, Get get) {
+    radix_sort(first, n, [&](const T &v) { return radix_key(get(v)); });
+  }
+
+  // sort sorts n instants with radix_sort. With more than one thread (all the
+  // cores when threads is 0), each thread sorts a part of the input and the
+  // parts are combined with merge_runs.
+  void sort(instant* first, size_t n, unsigned threads = 1);
+
+  // merge_runs merges k sorted runs into out with a k-way merge. Run i has
+  // sizes[i] instants starting at runs[i]. Equal instants are taken from
+  // the first run first.
+  void merge_runs(const instant* const* runs, const size_t* sizes, size_t k, instant* out);
+
+  // period is the step of an instant_range: years, months and days moved on
+  // the calendar like instant::add, then a fixed number of milliseconds.
+  struct period {
+    int years = 0;
+    int months = 0;
+    int days = 0;
+    long long millis = 0;
+
+    static constexpr period of_millis(long long n) { return period{0, 0, 0, n}; }
+    static constexpr period of_seconds(long long n) { return period{0, 0, 0, n * 1000}; }
+    static constexpr period of_days(int n) { return period{0, 0, n, 0}; }
+    static constexpr period of_months(int n) { return period{0, n, 0, 0}; }
+    static constexpr period of_years(int n) { return period{n, 0, 0, 0}; }
+  };
+
+  // instant_range is the lazy sequence of the instants start + k*step before
+  // end. Each element is computed from start and not from the previous one,
+  // so that the 31st of each month gives the 1st of the next one when the
+  // month is shorter without moving the following ones. The iterators are
+  // random access: operator[] and += compute any element in constant time,
+  // ++ only moves the cached month when the step has months. Their reference
+  // is the instant itself, returned by value as with the iterators of
+  // std::vector<bool>: the standard algorithms work, but *it is not an
+  // lvalue. The step must move forward in each of its parts, months and
+  // time, so that the sequence is sorted; other steps give an empty range.
+  class instant_range {
+  public:
+    class iterator {
+    public:
+      using iterator_category = std::random_access_iterator_tag;
+      using value_type = instant;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const instant*;
+      using reference = instant;
+
+      constexpr iterator() = default;
+
+      constexpr instant operator*() const { return cur; }
+      constexpr const instant* operator->() const { return &cur; }
+      constexpr instant operator[](difference_type n) const { return *(*this + n); }
+
+      constexpr iterator& operator++() { return *this += 1; }
+      constexpr iterator operator++(int) { auto it = *this; *this += 1; return it; }
+      constexpr iterator& operator--() { return *this += -1; }
+      constexpr iterator operator--(int) { auto it = *this; *this += -1; return it; }
+      constexpr iterator& operator+=(difference_type n);
+      constexpr iterator& operator-=(difference_type n) { return *this += -n; }
+      constexpr iterator operator+(difference_type n) const { auto it = *this; return it += n; }
+      constexpr iterator operator-(difference_type n) const { auto it = *this; return it += -n; }
+      constexpr difference_type operator-(const iterator &it) const { return k - it.k; }
+      friend constexpr iterator operator+(difference_type n, const iterator &it) { return it + n; }
+
+      constexpr bool operator==(const iterator &it) const { return k == it.k; }
+      constexpr bool operator!=(const iterator &it) const { return k != it.k; }
+      constexpr bool operator<(const iterator &it) const { return k < it.k; }
+      constexpr bool operator<=(const iterator &it) const { return k <= it.k; }
+      constexpr bool operator>(const iterator &it) const { return k > it.k; }
+      constexpr bool operator>=(const iterator &it) const { return k >= it.k; }
+
+    private:
+      friend class instant_range;
+
+      const instant_range* range = nullptr;
+      long long k = 0;
+      // months since the month of start, first day of that month and the
+      // offset from it in days and in milliseconds.
+      long long month = 0;
+      long long month_start = 0;
+      long long day = 0;
+      long long millis = 0;
+      instant cur;
+
+      constexpr iterator(const instant_range* r, long long k);
+      constexpr void update(bool moved);
+    };
+
+    constexpr instant_range(const instant &start, const instant &end, period step);
+
+    constexpr iterator begin() const { return iterator(this, 0); }
+    constexpr iterator end() const { return iterator(this, count); }
+    constexpr size_t size() const { return count; }
+    constexpr bool empty() const { return count == 0; }
+    constexpr instant operator[](size_t i) const { return begin()[i]; }
+
+  private:
+    instant start;
+    instant last;
+    period step;
+    // civil fields of start: year, month (from 0), day (from 0) and time of
+    // the day in milliseconds.
+    long long year = 0;
+    long long month = 0;
+    long long day = 0;
+    long long time = 0;
+    size_t count = 0;
+  };
 
-    static int epoch;
-    static int millis;
-    static std::vector<int> year_days;
-    static std::vector<int> month_days;
-    static std::vector<long long> leap_seconds;
+  constexpr instant_range::iterator::iterator(const instant_range* r, long long k):
+    range(r),
+    k(k),
+    month(k * (12LL * r->step.years + r->step.months)),
+    day(r->day + k * r->step.days),
+    millis(r->time + k * r->step.millis) {
+    update(true);
+  }
 
-    long long timestamp;
-    epoch_t zero = epoch_t::unix;
+  constexpr instant_range::iterator& instant_range::iterator::operator+=(difference_type n) {
+    long long months = 12LL * range->step.years + range->step.months;
+    k += n;
+    month += n * months;
+    day += n * range->step.days;
+    millis += n * range->step.millis;
+    update(months != 0);
+    return *this;
+  }
 
-    int year_day(int y, int m, int d) const;
+  constexpr void instant_range::iterator::update(bool moved) {
+    if (moved) {
+      long long m = range->month + month;
+      month_start = days_from_civil(range->year + floor_div(m, 12), floor_mod(m, 12) + 1, 1);
+    }
+    cur = range->start;
+    cur.timestamp = (month_start + day) * secondsPerDay * 1000 + millis;
+  }
 
-    int get_millis() const;
-    long long get_seconds() const;
+  constexpr instant_range::instant_range(const instant &start, const instant &end, period step):
+    start(start),
+    last(end),
+    step(step) {
+    constexpr long long msPerDay = secondsPerDay * 1000;
+    long long days = floor_div(start.timestamp, msPerDay);
+    auto [y, m, d] = civil_from_days(days);
+    year = y;
+    month = m - 1;
+    day = d - 1;
+    time = start.timestamp - days * msPerDay;
 
-    std::tuple<int, int, int> split_date() const;
-    std::tuple<int, int, int> split_time() const;
+    // the number of elements is first estimated with the mean length of the
+    // months of the gregorian calendar then adjusted.
+    long long months = 12LL * step.years + step.months;
+    long long forward = step.days * msPerDay + step.millis;
+    long long mean = months * 2629746000LL + forward;
+    long long span = end.timestamp - start.timestamp;
+    if (months < 0 || forward < 0 || mean <= 0 || span <= 0) {
+      return;
+    }
+    long long n = span / mean;
+    while (n > 0 && !(begin()[n-1] < end)) {
+      n--;
+    }
+    while (begin()[n] < end) {
+      n++;
+    }
+    count = n;
+  }
 
-    int adjust_pre_epoch(int year) const;
-    int adjust_post_epoch(int year) const;
+  // recurrence is a set of instants given field by field, compiled to one
+  // bitset per field: seconds, minutes, hours, days of the month, months and
+  // days of the week (0 for sunday). next_after finds the next instant of the
+  // set by jumping to the next bit of each field in turn, from the month down
+  // to the second, so it never scans minute by minute. All times are UTC.
+  class recurrence {
+  public:
+    // cron reads a cron expression: 5 fields (minute hour day month week day)
+    // or 6 with the seconds first. Each field is a list of *, n, a-b, with an
+    // optional /step; months and week days also accept their english names.
+    // The day of the month accepts L for the last day. When both the day of
+    // the month and the day of the week are restricted, a day matching any
+    // of them matches. @yearly, @monthly, @weekly, @daily and @hourly are
+    // accepted too.
+    static recurrence cron(std::string_view expr);
+    // rrule reads an iCalendar recurrence rule: FREQ from YEARLY to SECONDLY
+    // with BYMONTH, BYMONTHDAY (negative from the end of the month), BYDAY
+    // (without ordinal), BYHOUR, BYMINUTE and BYSECOND. The fields smaller
+    // than FREQ that are not given take their first value (january, the 1st,
+    // monday for WEEKLY, 00:00:00), except the month of a YEARLY rule with
+    // BYMONTHDAY or BYDAY, which takes every month. Rules that need a start date (INTERVAL
+    // other than 1, COUNT, UNTIL, BYSETPOS...) are rejected.
+    static recurrence rrule(std::string_view rule);
+
+    // next_after gives the first instant of the set after w, at a whole
+    // second. Rules that never match are rejected when they are read.
+    instant next_after(const instant &w) const;
+
+  private:
+    friend void next_after(const recurrence* rules, size_t n, const instant &w, instant* out);
+
+    uint64_t seconds = 0;
+    uint64_t minutes = 0;
+    uint32_t hours = 0;
+    // days has bit d for the d-th day of the month, last_days bit d for the
+    // d-th day before the end of the month (1 for the last day).
+    uint32_t days = 0;
+    uint32_t last_days = 0;
+    uint16_t months = 0;
+    uint8_t week_days = 0;
+    // day_or is set when a day matches either days or week_days.
+    bool day_or = false;
+
+    recurrence() = default;
+
+    void check() const;
+    uint64_t month_days(int year, int month) const;
+    instant next(civil c) const;
   };
+
+  // next_after gives the next instant after w of each of the n rules. The
+  // calendar fields of w are only computed once for all of them.
+  void next_after(const recurrence* rules, size_t n, const instant &w, instant* out);
+
+  // timer_wheel keeps deadlines in a hierarchical timing wheel with a
+  // millisecond resolution: 6 levels of 64 slots of 1ms, 64ms, 4s, 4.4min,
+  // 4.7h and 12.4 days, plus a list for the deadlines more than 2.2 years
+  // ahead. A deadline goes to the level of the highest group of 6 bits where
+  // it differs from the current time, so schedule, cancel and each step of
+  // advance_to take constant time. The timers are nodes of a pool linked by
+  // their indexes, reused after they fire or are cancelled.
+  class timer_wheel {
+  public:
+    // timer_id identifies a timer until it fires or is cancelled; ids of old
+    // timers are never taken for new ones. An id holds the index of a pooled
+    // node and its generation; a node is retired after 2^32-1 timers.
+    using timer_id = uint64_t;
+
+    struct expired {
+      instant deadline;
+      uint64_t data;
+    };
+
+    explicit timer_wheel(const instant &now);
+
+    // schedule adds a timer; deadlines not after now fire at the next call
+    // to advance_to.
+    timer_id schedule(const instant &deadline, uint64_t data);
+    // cancel removes a timer and returns false when it is not scheduled.
+    bool cancel(timer_id id);
+    // advance_to moves the time of the wheel forward to w and appends the
+    // timers with a deadline not after w to out, in the order of their
+    // deadlines. It returns the number of timers added.
+    size_t advance_to(const instant &w, std::vector<expired> &out);
+
+    instant now() const { return current; }
+    size_t size() const { return count; }
+
+  private:
+    static constexpr int levels = 6;
+    static constexpr int bits = 6;
+    static constexpr int slots = 1 << bits;
+    // the slots of all levels, then the list of the timers due and the one
+    // of the timers beyond the last level.
+    static constexpr uint32_t due = levels * slots;
+    static constexpr uint32_t overflow = due + 1;
+    static constexpr uint32_t nil = UINT32_MAX;
+
+    struct node {
+      instant deadline;
+      uint64_t data;
+      uint32_t next;
+      uint32_t prev;
+      uint32_t slot;
+      uint32_t gen;
+    };
+
+    std::vector<node> nodes;
+    uint32_t free_list = nil;
+    std::array<uint32_t, overflow + 1> heads;
+    std::array<uint32_t, overflow + 1> tails;
+    std::array<uint64_t, levels> used{};
+    instant current;
+    // now_ms is the radix_key of the time of the wheel.
+    uint64_t now_ms;
+    size_t count = 0;
+
+    void link(uint32_t i);
+    void unlink(uint32_t i);
+    void place(uint32_t i);
+    void cascade(uint32_t slot);
+    void release(uint32_t i);
+    void fire(uint32_t slot, std::vector<expired> &out);
+  };
+
+  // instant_column stores instants of a single time scale as contiguous
+  // milliseconds since the epoch, the scale of the first instant pushed.
+  // Instants of another scale are converted when they are pushed. The scans
+  // below use AVX2 when the CPU supports it. Their bitmaps have one bit per
+  // row, (size()+63)/64 words, the same way as the ones of parse_batch.
+  class instant_column {
+  public:
+    instant_column() = default;
+    instant_column(const instant* first, size_t n);
+
+    void push_back(const instant &w);
+    void reserve(size_t n) { values.reserve(n); }
+    void clear() { values.clear(); }
+
+    size_t size() const { return values.size(); }
+    bool empty() const { return values.empty(); }
+    instant operator[](size_t i) const;
+    const long long* data() const { return values.data(); }
+
+    // min and max return the zero instant on an empty column.
+    instant min() const;
+    instant max() const;
+    // before sets the bits of the rows before w and returns their number.
+    size_t before(const instant &w, uint64_t* bits) const;
+    // filter sets the bits of the rows in [from, to) and returns their number.
+    size_t filter(const instant &from, const instant &to, uint64_t* bits) const;
+
+  private:
+    std::vector<long long> values;
+    instant::epoch_t zero = instant::epoch_t::unix;
+
+    instant make(long long v) const;
+    // in_scale gives the timestamp of w in the time scale zero.
+    static long long in_scale(const instant &w, instant::epoch_t zero);
+  };
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+  // fixed_string wraps a string literal so that it can be given as a template
+  // argument.
+  template <size_t N>
+  struct fixed_string {
+    char str[N] = {};
+
+    constexpr fixed_string(const char (&s)[N]) {
+      for (size_t i = 0; i < N; i++) {
+        str[i] = s[i];
+      }
+    }
+
+    constexpr size_t size() const {
+      return N - 1;
+    }
+  };
+
+  // fixed_pattern is the compile time counterpart of formatter and parser.
+  // The pattern is checked and split into fields when the template is
+  // instantiated: errors in the pattern are compile errors. Every field has a
+  // fixed width (%Y is always 4 digits and %S is not supported) so the
+  // position of each field in the text is known at compile time too.
+  template <fixed_string P>
+  class fixed_pattern {
+  public:
+    enum class field_t {literal, year, month, day, year_day, hour, minute, second, millis};
+
+    struct op {
+      field_t field;
+      size_t pos;
+      size_t length;
+      size_t src;
+    };
+
+    static constexpr size_t count() {
+      size_t n = 0;
+      bool with_yday = false;
+      bool with_mday = false;
+      for (size_t i = 0; i < P.size(); i++, n++) {
+        if (P.str[i] != '%') {
+          while (i+1 < P.size() && P.str[i+1] != '%') {
+            i++;
+          }
+          continue;
+        }
+        if (++i == P.size()) {
+          throw parse_error(parse_errc::unknown_specifier, i);
+        }
+        switch (P.str[i]) {
+          case '%':
+          case 'Y':
+          case 'h':
+          case 'm':
+          case 's':
+          case 'f':
+          break;
+          case 'M':
+          case 'D':
+          if (with_yday) {
+            throw parse_error(parse_errc::year_day_conflict, i);
+          }
+          with_mday = true;
+          break;
+          case 'j':
+          if (with_mday) {
+            throw parse_error(parse_errc::year_day_conflict, i);
+          }
+          with_yday = true;
+          break;
+          case 'S':
+          throw parse_error("%S has no fixed width");
+          default:
+          throw parse_error(parse_errc::unknown_specifier, i);
+        }
+      }
+      return n;
+    }
+
+    static constexpr std::array<op, count()> compile() {
+      std::array<op, count()> ops{};
+      size_t n = 0;
+      size_t pos = 0;
+      for (size_t i = 0; i < P.size(); i++, n++) {
+        if (P.str[i] != '%') {
+          size_t beg = i;
+          while (i+1 < P.size() && P.str[i+1] != '%') {
+            i++;
+          }
+          ops[n] = op{field_t::literal, pos, i+1 - beg, beg};
+          pos += ops[n].length;
+          continue;
+        }
+        i++;
+        switch (P.str[i]) {
+          case '%':
+          ops[n] = op{field_t::literal, pos, 1, i};
+          break;
+          case 'Y':
+          ops[n] = op{field_t::year, pos, 4, i};
+          break;
+          case 'M':
+          ops[n] = op{field_t::month, pos, 2, i};
+          break;
+          case 'D':
+          ops[n] = op{field_t::day, pos, 2, i};
+          break;
+          case 'j':
+          ops[n] = op{field_t::year_day, pos, 3, i};
+          break;
+          case 'h':
+          ops[n] = op{field_t::hour, pos, 2, i};
+          break;
+          case 'm':
+          ops[n] = op{field_t::minute, pos, 2, i};
+          break;
+          case 's':
+          ops[n] = op{field_t::second, pos, 2, i};
+          break;
+          case 'f':
+          ops[n] = op{field_t::millis, pos, 3, i};
+          break;
+        }
+        pos += ops[n].length;
+      }
+      return ops;
+    }
+
+    static constexpr auto ops = compile();
+    static constexpr size_t length = ops.size() ? ops.back().pos + ops.back().length : 0;
+
+    // write writes exactly length characters in out. The year of w should
+    // be between 0 and 9999.
+    static constexpr void write(char* out, const instant &w) {
+      auto c = w.fields();
+      [&]<size_t... I>(std::index_sequence<I...>) {
+        (emit<ops[I]>(out, c), ...);
+      }(std::make_index_sequence<ops.size()>{});
+    }
+
+    static constexpr parse_result read(std::string_view str) noexcept {
+      parse_result res;
+      civil c{0, 1, 1, -1, 0, 0, 0, 0, 0};
+      size_t day_offset = 0;
+      bool ok = [&]<size_t... I>(std::index_sequence<I...>) {
+        return (scan<ops[I]>(str, c, day_offset, res) && ...);
+      }(std::make_index_sequence<ops.size()>{});
+      if (!ok) {
+        return res;
+      }
+      if (str.size() > length) {
+        res.error = parse_errc::trailing_input;
+        res.offset = length;
+        return res;
+      }
+      if (c.year_day > 0) {
+        c.month = 1;
+        c.day = c.year_day;
+      } else if (c.day > days_in_month(c.year, c.month)) {
+        res.error = parse_errc::invalid_month_day;
+        res.offset = day_offset;
+        return res;
+      }
+      res.value = instant(instant(c.year, c.month, c.day, c.hour, c.minute, c.second).unix(), c.millis);
+      return res;
+    }
+
+  private:
+    template <field_t F>
+    static constexpr int value(const civil &c) {
+      if constexpr (F == field_t::year) {
+        return c.year;
+      } else if constexpr (F == field_t::month) {
+        return c.month;
+      } else if constexpr (F == field_t::day) {
+        return c.day;
+      } else if constexpr (F == field_t::year_day) {
+        return c.year_day;
+      } else if constexpr (F == field_t::hour) {
+        return c.hour;
+      } else if constexpr (F == field_t::minute) {
+        return c.minute;
+      } else if constexpr (F == field_t::second) {
+        return c.second;
+      } else {
+        return c.millis;
+      }
+    }
+
+    template <op O>
+    static constexpr void emit(char* out, const civil &c) {
+      if constexpr (O.field == field_t::literal) {
+        for (size_t i = 0; i < O.length; i++) {
+          out[O.pos+i] = P.str[O.src+i];
+        }
+      } else {
+        int v = value<O.field>(c);
+        for (size_t i = O.length; i-- > 0;) {
+          out[O.pos+i] = '0' + (v % 10);
+          v /= 10;
+        }
+      }
+    }
+
+    template <op O>
+    static constexpr bool scan(std::string_view str, civil &c, size_t &day_offset, parse_result &res) {
+      int v = 0;
+      for (size_t i = 0; i < O.length; i++) {
+        size_t at = O.pos + i;
+        if (at >= str.size()) {
+          res.error = parse_errc::unexpected_end;
+          res.offset = at;
+          return false;
+        }
+        if constexpr (O.field == field_t::literal) {
+          if (str[at] != P.str[O.src+i]) {
+            res.error = parse_errc::unexpected_character;
+            res.offset = at;
+            return false;
+          }
+        } else {
+          unsigned d = str[at] - '0';
+          if (d > 9) {
+            res.error = parse_errc::unexpected_character;
+            res.offset = at;
+            return false;
+          }
+          v = v * 10 + d;
+        }
+      }
+
+      auto err = parse_errc::none;
+      if constexpr (O.field == field_t::year) {
+        c.year = v;
+      } else if constexpr (O.field == field_t::month) {
+        c.month = v;
+        err = v < 1 || v > 12 ? parse_errc::invalid_month : err;
+      } else if constexpr (O.field == field_t::day) {
+        c.day = v;
+        day_offset = O.pos;
+        err = v < 1 || v > 31 ? parse_errc::invalid_day : err;
+      } else if constexpr (O.field == field_t::year_day) {
+        c.year_day = v;
+        err = v < 1 || v > 366 ? parse_errc::invalid_year_day : err;
+      } else if constexpr (O.field == field_t::hour) {
+        c.hour = v;
+        err = v > 23 ? parse_errc::invalid_hour : err;
+      } else if constexpr (O.field == field_t::minute) {
+        c.minute = v;
+        err = v > 59 ? parse_errc::invalid_minute : err;
+      } else if constexpr (O.field == field_t::second) {
+        c.second = v;
+        err = v > 59 ? parse_errc::invalid_second : err;
+      } else if constexpr (O.field == field_t::millis) {
+        c.millis = v;
+      }
+      if (err != parse_errc::none) {
+        res.error = err;
+        res.offset = O.pos;
+        return false;
+      }
+      return true;
+    }
+  };
+
+  // format_size is the exact length of the text written by format_to<P>.
+  template <fixed_string P>
+  constexpr size_t format_size = fixed_pattern<P>::length;
+
+  template <fixed_string P>
+  constexpr char* format_to(char* out, const instant &w) {
+    fixed_pattern<P>::write(out, w);
+    return out + format_size<P>;
+  }
+
+  template <fixed_string P>
+  std::string format(const instant &w) {
+    std::string str(format_size<P>, 0);
+    format_to<P>(str.data(), w);
+    return str;
+  }
+
+  template <fixed_string P>
+  constexpr parse_result try_parse(std::string_view str) noexcept {
+    return fixed_pattern<P>::read(str);
+  }
+
+  template <fixed_string P>
+  constexpr instant parse(std::string_view str) {
+    auto res = fixed_pattern<P>::read(str);
+    if (!res) {
+      throw parse_error(res.error, res.offset);
+    }
+    return res.value;
+  }
+
+  inline namespace literals {
+    // _instant accepts a date (YYYY-MM-DD) or any of the layouts of
+    // instant::parse_iso. Invalid literals are compile errors.
+    template <fixed_string S>
+    consteval instant operator""_instant() {
+      constexpr std::string_view str(S.str, S.size());
+      constexpr bool t = str.size() > 10 && str[10] == 'T';
+      constexpr bool z = !str.empty() && str.back() == 'Z';
+      constexpr bool f = str.size() - z == 23;
+      if constexpr (str.size() == 10) {
+        return parse<"%Y-%M-%D">(str);
+      } else if constexpr (t && f) {
+        return z ? parse<"%Y-%M-%DT%h:%m:%s.%fZ">(str) : parse<"%Y-%M-%DT%h:%m:%s.%f">(str);
+      } else if constexpr (t) {
+        return z ? parse<"%Y-%M-%DT%h:%m:%sZ">(str) : parse<"%Y-%M-%DT%h:%m:%s">(str);
+      } else if constexpr (f) {
+        return z ? parse<"%Y-%M-%D %h:%m:%s.%fZ">(str) : parse<"%Y-%M-%D %h:%m:%s.%f">(str);
+      } else {
+        return z ? parse<"%Y-%M-%D %h:%m:%sZ">(str) : parse<"%Y-%M-%D %h:%m:%s">(str);
+      }
+    }
+  }
+#endif
 }
 
 #endif
@@ -1,4 +1,6 @@
 #define CATCH_CONFIG_MAIN
+#include <sstream>
+#include <type_traits>
 #include "catch.hpp"
 #include "ever.h"
 
@@ -130,4 +132,979 @@ TEST_CASE("format") {
   CHECK(time.format("%Y-%M-%D %h:%m:%s") == "1970-01-01 00:00:00");
   CHECK(time.format("%Y-%M-%D %h:%m:%s.%f") == "1970-01-01 00:00:00.000");
   CHECK(time.format("%Y/%j") == "1970/001");
+  CHECK(time.format("%S") == "0");
+  CHECK(ever::formatter("%S|%S").format(time) == "0|0");
+}
+
+TEST_CASE("formatter") {
+  ever::formatter fmt("%Y-%M-%D %h:%m:%s.%f");
+  ever::instant time{2020, 7, 14, 13, 48, 18};
+
+  CHECK(fmt.format(time) == time.format("%Y-%M-%D %h:%m:%s.%f"));
+  CHECK(fmt.format(time) == "2020-07-14 13:48:18.000");
+  CHECK(ever::formatter("%S|%j|%%|%J").format(time) == "1594734498|196|%|?");
+
+  SECTION("format_to") {
+    char buf[32];
+    CHECK(fmt.format_to(buf, sizeof(buf), time) == 23);
+    CHECK(std::string(buf, 23) == "2020-07-14 13:48:18.000");
+  }
+
+  SECTION("format_to short buffer") {
+    char buf[8];
+    CHECK(fmt.format_to(buf, sizeof(buf), time) == 23);
+    CHECK(std::string(buf, sizeof(buf)) == "2020-07-");
+  }
+}
+
+TEST_CASE("parser") {
+  ever::parser p("%Y-%M-%D %h:%m:%s");
+
+  CHECK(p.parse("2020-07-14 13:48:18") == ever::instant(2020, 7, 14, 13, 48, 18));
+  CHECK(p.parse("1970-01-01 00:00:00") == ever::instant(0));
+  CHECK(p.parse("2020-02-29 00:00:00") == ever::instant(2020, 2, 29));
+  CHECK_THROWS_AS(p.parse("2019-02-29 00:00:00"), ever::parse_error);
+  CHECK_THROWS_AS(p.parse("2020-07-14 13:48"), ever::parse_error);
+  CHECK_THROWS_AS(p.parse("2020-07-14 13:4x:18"), ever::parse_error);
+
+  std::string str = "[2020-07-14 13:48:18]";
+  CHECK(p.parse(str.data()+1, str.data()+str.size()-1) == ever::instant(2020, 7, 14, 13, 48, 18));
+
+  SECTION("day of year") {
+    ever::parser p("%Y/%j");
+    CHECK(p.parse("1970/001") == ever::instant(1970, 1, 1));
+    CHECK(p.parse("1970/060") == ever::instant(1970, 3, 1));
+    CHECK(p.parse("1972/060") == ever::instant(1972, 2, 29));
+    CHECK(p.parse("2020/196") == ever::instant(2020, 7, 14));
+  }
+
+  SECTION("invalid pattern") {
+    CHECK_THROWS_AS(ever::parser("%Y-%J"), ever::parse_error);
+    CHECK_THROWS_AS(ever::parser("%Y/%M/%j"), ever::parse_error);
+  }
+}
+
+TEST_CASE("try parse") {
+  std::string pattern = "%Y-%M-%D %h:%m:%s";
+
+  auto check_error = [&](std::string str, ever::parse_errc err, size_t offset) {
+    auto res = ever::instant::try_parse(pattern, str);
+    CHECK(!res);
+    CHECK(res.error == err);
+    CHECK(res.offset == offset);
+
+    res = ever::parser(pattern).try_parse(str);
+    CHECK(res.error == err);
+    CHECK(res.offset == offset);
+  };
+
+  auto res = ever::instant::try_parse(pattern, "2020-07-14 13:48:18");
+  CHECK(res);
+  CHECK(res.value == ever::instant(2020, 7, 14, 13, 48, 18));
+
+  check_error("1970-13-01 00:00:00", ever::parse_errc::invalid_month, 5);
+  check_error("1970-01-45 00:00:00", ever::parse_errc::invalid_day, 8);
+  check_error("1970-04-31 00:00:00", ever::parse_errc::invalid_month_day, 8);
+  check_error("1970-01-01 25:00:00", ever::parse_errc::invalid_hour, 11);
+  check_error("1970-01-01 00:69:00", ever::parse_errc::invalid_minute, 14);
+  check_error("1970-01-01 00:00:79", ever::parse_errc::invalid_second, 17);
+  check_error("1970-01-01T00:00:00", ever::parse_errc::unexpected_character, 10);
+  check_error("1970-01-0a 00:00:00", ever::parse_errc::unexpected_character, 9);
+  check_error("1970-01-01 00:00", ever::parse_errc::unexpected_end, 16);
+  check_error("1970-01-01 00:00:00Z", ever::parse_errc::trailing_input, 19);
+
+  CHECK(ever::instant::try_parse("%Y/%j", "1970/453").error == ever::parse_errc::invalid_year_day);
+  CHECK(ever::instant::try_parse("%Y/%M/%j", "1970/01/001").error == ever::parse_errc::year_day_conflict);
+  CHECK(ever::instant::try_parse("%Y/%j/%D", "1970/001/01").error == ever::parse_errc::year_day_conflict);
+  CHECK(ever::instant::try_parse("%Y.%J", "1970.001").error == ever::parse_errc::unknown_specifier);
+
+  try {
+    ever::instant::parse(pattern, "1970-04-31 00:00:00");
+  } catch (ever::parse_error &e) {
+    CHECK(e.code() == ever::parse_errc::invalid_month_day);
+    CHECK(e.offset() == 8);
+  }
+}
+
+TEST_CASE("fields") {
+  ever::instant i{1594734498, 250};
+  auto c = i.fields();
+
+  CHECK(c.year == i.year());
+  CHECK(c.month == i.month());
+  CHECK(c.day == i.month_day());
+  CHECK(c.year_day == i.year_day());
+  CHECK(c.week_day == i.week_day());
+  CHECK(c.hour == i.hour());
+  CHECK(c.minute == i.minutes());
+  CHECK(c.second == i.seconds());
+  CHECK(c.millis == 250);
+  CHECK(i.jd() == Approx(2459045.075208).epsilon(1e-9));
+
+  CHECK(ever::instant{1969, 12, 20}.week_day() == 0);
+}
+
+TEST_CASE("round trip") {
+  SECTION("all days from year 1 to 9999") {
+    const int month_days[] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    long long unix = ever::instant{1, 1, 1}.unix();
+    int failures = 0;
+    for (int y = 1; y <= 9999; y++) {
+      int yday = 1;
+      for (int m = 1; m <= 12; m++) {
+        int days = month_days[m] + (m == 2 && ever::is_leap(y));
+        for (int d = 1; d <= days; d++, yday++, unix += 86400) {
+          ever::instant i{y, m, d};
+          auto c = ever::instant{unix, 0}.fields();
+          if (i.unix() != unix || c.year != y || c.month != m || c.day != d || c.year_day != yday) {
+            if (failures++ < 10) {
+              FAIL_CHECK(y << "-" << m << "-" << d << ": " << i.unix() << " != " << unix);
+            }
+          }
+        }
+      }
+    }
+    CHECK(failures == 0);
+    CHECK(ever::instant{9999, 12, 31}.add(86400).format("%Y-%M-%D") == "10000-01-01");
+  }
+
+  SECTION("before epoch") {
+    CHECK(ever::instant{-1}.format("%Y-%M-%D %h:%m:%s") == "1969-12-31 23:59:59");
+    CHECK(ever::instant{-3600}.format("%Y-%M-%D %h:%m:%s") == "1969-12-31 23:00:00");
+    CHECK(ever::instant{-86400}.format("%Y-%M-%D %h:%m:%s") == "1969-12-31 00:00:00");
+    CHECK(ever::instant{1600, 3, 1}.format("%Y-%M-%D %j") == "1600-03-01 061");
+    CHECK(ever::instant{1700, 3, 1}.format("%Y-%M-%D %j") == "1700-03-01 060");
+  }
+
+  SECTION("normalize") {
+    CHECK(ever::instant{2020, 13, 1} == ever::instant{2021, 1, 1});
+    CHECK(ever::instant{2020, 0, 1} == ever::instant{2019, 12, 1});
+    CHECK(ever::instant{2020, 3, 0} == ever::instant{2020, 2, 29});
+    CHECK(ever::instant{2020, 1, 1, -1} == ever::instant{2019, 12, 31, 23});
+  }
+}
+
+TEST_CASE("split batch") {
+  std::vector<long long> millis{0, -1, -1000, -1001, 999, 1000, 86399999, 86400000, -86400001, 1594734498250LL, -62135596800000LL, 253402300799999LL, -(1LL << 52), 1LL << 52};
+  long long seed = 88172645463325252LL;
+  for (int i = 0; i < 10000; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    millis.push_back(seed % 400000000000000LL);
+  }
+
+  size_t n = millis.size();
+  std::vector<int> year(n), month(n), day(n), hour(n), minute(n), second(n);
+  ever::split_batch(millis.data(), n, {year.data(), month.data(), day.data(), hour.data(), minute.data(), second.data()});
+
+  int failures = 0;
+  for (size_t i = 0; i < n; i++) {
+    ever::instant w{millis[i] / 1000, static_cast<int>(millis[i] % 1000)};
+    auto c = w.fields();
+    if (c.year != year[i] || c.month != month[i] || c.day != day[i] || c.hour != hour[i] || c.minute != minute[i] || c.second != second[i]) {
+      if (failures++ < 10) {
+        FAIL_CHECK(millis[i] << ": " << w.to_string());
+      }
+    }
+  }
+  CHECK(failures == 0);
+}
+
+TEST_CASE("millis before the epoch") {
+  auto w = ever::instant::parse_iso("1969-12-31T23:59:59.999");
+  CHECK(w.diff_millis(ever::instant{0}) == -1);
+  CHECK(w.format() == "1969-12-31 23:59:59.999");
+  CHECK(w.format("%S.%f") == "-1.999");
+  CHECK(w.month_day() == 31);
+  CHECK(w.unix() == -1);
+  CHECK(w.floor(ever::time_unit::day) == ever::instant{1969, 12, 31});
+  CHECK(w.floor(ever::time_unit::second) == ever::instant{-1});
+
+  ever::instant v{-1, -500};
+  CHECK(v.format() == "1969-12-31 23:59:58.500");
+  CHECK(v.floor(ever::time_unit::second).format() == "1969-12-31 23:59:58.000");
+  auto c = v.fields();
+  CHECK(c.day == 31);
+  CHECK(c.second == 58);
+  CHECK(c.millis == 500);
+
+  std::vector<long long> millis{-1, -500, -1500, -86400001, -999, -1000};
+  size_t n = millis.size();
+  std::vector<int> year(n), month(n), day(n), hour(n), minute(n), second(n);
+  ever::split_batch(millis.data(), n, {year.data(), month.data(), day.data(), hour.data(), minute.data(), second.data()});
+  ever::stream_formatter stream("%Y-%M-%D %h:%m:%s.%f");
+  for (size_t i = 0; i < n; i++) {
+    ever::instant t{0, static_cast<int>(millis[i])};
+    auto f = t.fields();
+    CHECK(f.year == year[i]);
+    CHECK(f.month == month[i]);
+    CHECK(f.day == day[i]);
+    CHECK(f.hour == hour[i]);
+    CHECK(f.minute == minute[i]);
+    CHECK(f.second == second[i]);
+    CHECK(stream.format(t) == t.format());
+  }
+  CHECK(second[0] == 59);
+  CHECK(second[2] == 58);
+  CHECK(day[3] == 30);
+}
+
+TEST_CASE("parse iso") {
+  ever::instant want{1594734498, 0};
+
+  CHECK(ever::instant::parse_iso("2020-07-14T13:48:18") == want);
+  CHECK(ever::instant::parse_iso("2020-07-14 13:48:18") == want);
+  CHECK(ever::instant::parse_iso("2020-07-14T13:48:18Z") == want);
+  CHECK(ever::instant::parse_iso("2020-07-14T13:48:18.250Z") == ever::instant{1594734498, 250});
+  CHECK(ever::instant::parse_iso("2020-07-14 13:48:18.250") == ever::instant{1594734498, 250});
+  CHECK(ever::instant::parse_iso("1969-12-31T23:59:59.999") == ever::instant{0, -1});
+  CHECK(ever::instant::parse_iso("2020-02-29T00:00:00") == ever::instant(2020, 2, 29));
+  CHECK(ever::instant::parse_iso("-0454-09-08T06:34:18") == ever::instant(-454, 9, 8, 6, 34, 18));
+
+  CHECK(ever::instant::try_parse_iso("2020-07-14T13:48").error == ever::parse_errc::unexpected_end);
+  CHECK(ever::instant::try_parse_iso("2020-07-14X13:48:18").error == ever::parse_errc::unexpected_character);
+  CHECK(ever::instant::try_parse_iso("2020-07-14T13:48:1a").offset == 18);
+  CHECK(ever::instant::try_parse_iso("2019-02-29T00:00:00").error == ever::parse_errc::invalid_month_day);
+  CHECK(ever::instant::try_parse_iso("2020-13-14T13:48:18").error == ever::parse_errc::invalid_month);
+  CHECK(ever::instant::try_parse_iso("2020-07-14T24:48:18").error == ever::parse_errc::invalid_hour);
+  CHECK(ever::instant::try_parse_iso("2020-07-14T13:48:60Z").error == ever::parse_errc::invalid_second);
+
+  SECTION("parser fast path") {
+    ever::parser p("%Y-%M-%DT%h:%m:%s.%fZ");
+    CHECK(p.parse("2020-07-14T13:48:18.250Z") == ever::instant{1594734498, 250});
+    CHECK_THROWS_AS(p.parse("2020-07-14 13:48:18.250Z"), ever::parse_error);
+    CHECK_THROWS_AS(p.parse("2020-07-14T13:48:18Z"), ever::parse_error);
+  }
+}
+
+TEST_CASE("constexpr") {
+  constexpr ever::instant i{2020, 7, 14, 13, 48, 18};
+  static_assert(i.unix() == 1594734498, "unix");
+  static_assert(i.year() == 2020 && i.month() == 7 && i.month_day() == 14, "date");
+  static_assert(i.hour() == 13 && i.minutes() == 48 && i.seconds() == 18, "time");
+  static_assert(i.year_day() == 196, "year day");
+  static_assert(i.add(-1, -7, 0) == ever::instant{2018, 12, 14, 13, 48, 18}, "add");
+  static_assert(ever::instant{1980, 1, 6}.diff(ever::instant{0}) == 315964800, "diff");
+  static_assert(ever::instant{0}.jd() == 2440587.5, "jd");
+  static_assert(ever::instant{0} < i, "compare");
+  CHECK(i.unix() == 1594734498);
+}
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+TEST_CASE("fixed patterns") {
+  using namespace ever::literals;
+
+  constexpr auto i = "2020-07-14 13:48:18"_instant;
+  static_assert(i == ever::instant{2020, 7, 14, 13, 48, 18}, "literal");
+  static_assert("2020-07-14T13:48:18.250Z"_instant == ever::instant{1594734498, 250}, "literal");
+  static_assert("2020-07-14"_instant == ever::instant{2020, 7, 14}, "literal");
+  static_assert(ever::format_size<"%Y-%M-%D %h:%m:%s.%f"> == 23, "size");
+
+  CHECK(ever::format<"%Y-%M-%D %h:%m:%s.%f">(i) == i.format("%Y-%M-%D %h:%m:%s.%f"));
+  CHECK(ever::format<"%Y/%j %%">(i) == "2020/196 %");
+
+  CHECK(ever::parse<"%Y-%M-%D %h:%m:%s">("2020-07-14 13:48:18") == i);
+  CHECK(ever::parse<"%Y/%j">("2020/196") == ever::instant{2020, 7, 14});
+  CHECK(ever::parse<"%Y/%j">("1972/060") == ever::instant{1972, 2, 29});
+
+  auto check_error = [](ever::parse_result res, ever::parse_errc err, size_t offset) {
+    CHECK(res.error == err);
+    CHECK(res.offset == offset);
+  };
+  check_error(ever::try_parse<"%Y-%M-%D %h:%m:%s">("1970-04-31 00:00:00"), ever::parse_errc::invalid_month_day, 8);
+  check_error(ever::try_parse<"%Y-%M-%D %h:%m:%s">("1970-01-01 00:00"), ever::parse_errc::unexpected_end, 16);
+  check_error(ever::try_parse<"%Y-%M-%D %h:%m:%s">("1970-01-01T00:00:00"), ever::parse_errc::unexpected_character, 10);
+  check_error(ever::try_parse<"%Y-%M-%D %h:%m:%s">("1970-01-01 00:00:00Z"), ever::parse_errc::trailing_input, 19);
+  check_error(ever::try_parse<"%Y-%M-%D %h:%m:%s">("1970-01-01 00:69:00"), ever::parse_errc::invalid_minute, 14);
+  CHECK_THROWS_AS(ever::parse<"%Y-%M-%D">("1970-13-01"), ever::parse_error);
+}
+#endif
+
+TEST_CASE("leap seconds") {
+  ever::instant before{2016, 12, 31, 23, 59, 59};
+  ever::instant after{2017, 1, 1, 0, 0, 0};
+
+  CHECK(before.to_gps().diff(before) == 17);
+  CHECK(after.to_gps().diff(after) == 18);
+  CHECK(ever::instant{1980, 1, 6}.to_gps().diff(ever::instant{1980, 1, 6}) == 0);
+  CHECK(after.to_tai().diff(after) == 37);
+
+  CHECK(after.diff(before) == 1);
+  CHECK(after.diff_leap(before) == 2);
+  CHECK(after.diff_leap(ever::instant{1980, 1, 6}) == after.diff(ever::instant{1980, 1, 6}) + 18);
+
+  SECTION("round trip") {
+    for (auto w: {before, after, ever::instant{1990, 1, 1, 0, 0, 0}, ever::instant{1970, 1, 1}, ever::instant{1594734498, 250}}) {
+      CHECK(w.to_gps().to_unix() == w);
+      CHECK(w.to_tai().to_unix() == w);
+      CHECK(w.to_tai().to_gps() == w.to_gps());
+    }
+  }
+
+  SECTION("batch") {
+    std::vector<ever::instant> utc;
+    for (long long s = 1483228700; s < 1483228900; s += 7) {
+      utc.push_back(ever::instant{s, 500});
+    }
+    std::vector<ever::instant> gps(utc.size()), tai(utc.size()), back(utc.size());
+    ever::to_gps(utc.data(), utc.size(), gps.data());
+    ever::to_tai(utc.data(), utc.size(), tai.data());
+    ever::to_unix(gps.data(), gps.size(), back.data());
+    for (size_t i = 0; i < utc.size(); i++) {
+      CHECK(gps[i] == utc[i].to_gps());
+      CHECK(tai[i] == utc[i].to_tai());
+      CHECK(back[i] == utc[i]);
+    }
+  }
+}
+
+TEST_CASE("leap table") {
+  const ever::instant after{2017, 1, 1};
+
+  SECTION("leap-seconds.list") {
+    std::istringstream in(
+      "#\tUpdated through IERS Bulletin C\n"
+      "#@\t3960057600\n"
+      "2272060800\t10\t# 1 Jan 1972\n"
+      "2287785600\t11\t# 1 Jul 1972\n"
+      "2524521600\t19\t# 1 Jan 1980\n"
+      "2571782400\t20\t# 1 Jul 1981\n"
+      "3692217600\t37\t# 1 Jan 2017\n"
+    );
+    auto t = ever::leap_table::parse(in);
+    CHECK(t.size() == 2);
+    CHECK(t.expires() == 3960057600LL - 2208988800LL);
+    CHECK(t.utc_bucket(after.unix()).count == 18);
+    CHECK(t.utc_bucket(after.unix()-1).count == 1);
+    CHECK(t.gps_bucket(after.unix()+17).count == 1);
+    CHECK(t.gps_bucket(after.unix()+18).count == 18);
+  }
+
+  SECTION("tz leapseconds") {
+    std::istringstream in(
+      "# Leap YEAR MONTH DAY HH:MM:SS CORR R/S\n"
+      "Leap\t1972\tJun\t30\t23:59:60\t+\tS\n"
+      "Leap\t1972\tDec\t31\t23:59:60\t+\tS\n"
+      "Leap\t1973\tDec\t31\t23:59:60\t+\tS\n"
+      "Leap\t1974\tDec\t31\t23:59:60\t+\tS\n"
+      "Leap\t1975\tDec\t31\t23:59:60\t+\tS\n"
+      "Leap\t1976\tDec\t31\t23:59:60\t+\tS\n"
+      "Leap\t1977\tDec\t31\t23:59:60\t+\tS\n"
+      "Leap\t1978\tDec\t31\t23:59:60\t+\tS\n"
+      "Leap\t1979\tDec\t31\t23:59:60\t+\tS\n"
+      "Leap\t1981\tJun\t30\t23:59:60\t+\tS\n"
+      "Leap\t1982\tJun\t30\t23:59:60\t+\tS\n"
+      "Expires\t2025\tDec\t28\t00:00:00\n"
+    );
+    auto t = ever::leap_table::parse(in);
+    CHECK(t.size() == 2);
+    CHECK(t.expires() == ever::instant{2025, 12, 28}.unix());
+    CHECK(t.utc_bucket(ever::instant{1981, 7, 1}.unix()).count == 1);
+    CHECK(t.utc_bucket(ever::instant{1982, 7, 1}.unix()).count == 2);
+    CHECK(t.utc_bucket(ever::instant{1982, 6, 30}.unix()).count == 1);
+  }
+
+  SECTION("install") {
+    std::istringstream in("2571782400\t20\n3692217600\t37\n3944678400\t38\n");
+    ever::leap_table::install(ever::leap_table::parse(in));
+    CHECK(ever::instant{2025, 1, 1}.to_gps().diff(ever::instant{2025, 1, 1}) == 19);
+    CHECK(after.to_gps().diff(after) == 18);
+
+    ever::leap_table::install(ever::leap_table::builtin());
+    CHECK(ever::instant{2025, 1, 1}.to_gps().diff(ever::instant{2025, 1, 1}) == 18);
+  }
+
+  SECTION("invalid list") {
+    std::istringstream in("3692217600\t37\n2571782400\t20\n");
+    CHECK_THROWS_AS(ever::leap_table::parse(in), ever::parse_error);
+    CHECK_THROWS_AS(ever::leap_table::load("/does/not/exist"), ever::parse_error);
+  }
+}
+
+TEST_CASE("time cache") {
+  ever::time_cache cache("%Y-%M-%D %h:%m:%s.%f|%f");
+  ever::formatter fmt("%Y-%M-%D %h:%m:%s.%f|%f");
+
+  ever::instant t{1594734498, 250};
+  CHECK(cache.stamp(t) == fmt.format(t));
+  for (int ms: {251, 999, 0, 7}) {
+    ever::instant w{1594734498, ms};
+    CHECK(cache.stamp(w) == fmt.format(w));
+  }
+  CHECK(cache.stamp(ever::instant{1594734499, 7}) == "2020-07-14 13:48:19.007|007");
+  CHECK(cache.stamp(ever::instant{-1, -250}) == fmt.format(ever::instant{-1, -250}));
+
+  auto now = ever::instant::now();
+  auto got = ever::instant::parse_iso(ever::time_cache::local().stamp());
+  CHECK(std::abs(got.diff_millis(now)) < 5000);
+}
+
+TEST_CASE("fast clock") {
+  auto before = ever::instant::now();
+  auto got = ever::fast_clock::now();
+  auto after = ever::instant::now();
+  CHECK(got.diff_millis(before) >= -5);
+  CHECK(after.diff_millis(got) >= -5);
+
+  long long last = ever::fast_clock::now_nanos();
+  int backward = 0;
+  for (int i = 0; i < 1000; i++) {
+    long long now = ever::fast_clock::now_nanos();
+    backward += now < last - 1000000;
+    last = now;
+  }
+  CHECK(backward == 0);
+}
+
+TEST_CASE("stream formatter") {
+  SECTION("sorted") {
+    const char* pattern = "%Y-%M-%D %h:%m:%s.%f (%j)";
+    ever::stream_formatter stream(pattern);
+    ever::formatter fmt(pattern);
+    long long base = ever::instant{2019, 12, 31, 23, 58, 0}.unix() * 1000;
+    int mismatch = 0;
+    for (int i = 0; i < 20000; i++) {
+      base += (i * 37) % 1500;
+      ever::instant t{base / 1000, int(base % 1000)};
+      mismatch += stream.format(t) != fmt.format(t);
+    }
+    CHECK(mismatch == 0);
+  }
+  SECTION("unordered") {
+    const char* pattern = "%S %h:%m:%s.%f";
+    ever::stream_formatter stream(pattern);
+    ever::formatter fmt(pattern);
+    for (auto t: {ever::instant{100, 5}, ever::instant{100, 6}, ever::instant{99, 999}, ever::instant{-1, -5}, ever::instant{-1, -5}, ever::instant{86399, 0}}) {
+      CHECK(stream.format(t) == fmt.format(t));
+    }
+  }
+}
+
+TEST_CASE("search lines") {
+  std::string text =
+    "continued\n"
+    "[2020-07-14 10:00:00] a\n"
+    "[2020-07-14 10:00:05] b\n"
+    "  at frame\n"
+    "[2020-07-14 10:00:05] c\n"
+    "[2020-07-14 10:01:00] d\n"
+    "[2020-07-14 11:00:00] e\n";
+  ever::parser p("%Y-%M-%D %h:%m:%s");
+  auto at = [&](const char* str) { return p.parse(str); };
+  auto lines = [&](ever::line_range r) { return text.substr(r.first, r.last - r.first); };
+
+  auto r = ever::search_lines(text, p, 1, at("2020-07-14 10:00:05"), at("2020-07-14 11:00:00"));
+  CHECK(lines(r) == "[2020-07-14 10:00:05] b\n  at frame\n[2020-07-14 10:00:05] c\n[2020-07-14 10:01:00] d\n");
+
+  r = ever::search_lines(text, p, 1, at("2020-07-14 09:00:00"), at("2020-07-14 10:00:01"));
+  CHECK(lines(r) == "[2020-07-14 10:00:00] a\n");
+
+  r = ever::search_lines(text, p, 1, at("2020-07-14 10:30:00"), at("2020-07-15 00:00:00"));
+  CHECK(lines(r) == "[2020-07-14 11:00:00] e\n");
+
+  r = ever::search_lines(text, p, 1, at("2020-07-14 12:00:00"), at("2020-07-15 00:00:00"));
+  CHECK(r.first == text.size());
+  CHECK(r.last == text.size());
+
+  r = ever::search_lines(text, p, 1, at("2020-07-14 10:01:00"), at("2020-07-14 10:00:00"));
+  CHECK(r.first == r.last);
+}
+
+TEST_CASE("parse batch") {
+  std::vector<std::string> rows;
+  for (int i = 0; i < 100000; i++) {
+    if (i % 7 == 3) {
+      rows.push_back("2020-13-01 00:00:00");
+    } else {
+      rows.push_back(ever::instant{1594734498LL + i * 61}.format("%Y-%M-%D %h:%m:%s"));
+    }
+  }
+  std::vector<std::string_view> views(rows.begin(), rows.end());
+  std::vector<ever::instant> out(rows.size());
+  std::vector<uint64_t> errors((rows.size() + 63) / 64);
+
+  for (unsigned threads: {1u, 4u, 0u}) {
+    size_t bad = ever::parse_batch("%Y-%M-%D %h:%m:%s", views.data(), views.size(), out.data(), errors.data(), threads);
+    CHECK(bad == 14286);
+    int mismatch = 0;
+    for (size_t i = 0; i < rows.size(); i++) {
+      bool failed = errors[i / 64] >> (i % 64) & 1;
+      if (i % 7 == 3) {
+        mismatch += !failed;
+      } else {
+        mismatch += failed || out[i].unix() != 1594734498LL + (long long)i * 61;
+      }
+    }
+    CHECK(mismatch == 0);
+  }
+
+  CHECK(ever::parse_batch("%Y-%Q", views.data(), 70, out.data(), errors.data()) == 70);
+  CHECK(errors[0] == ~uint64_t(0));
+  CHECK(errors[1] == 0x3f);
+}
+
+TEST_CASE("multi parser") {
+  ever::multi_parser mp{
+    "%Y-%M-%DT%h:%m:%s.%fZ",
+    "%Y-%M-%D %h:%m:%s",
+    "%Y-%M-%DT%h:%m:%s",
+    "%Y/%j %h:%m:%s",
+    "%Y%M%D",
+    "%Y%j",
+    "%Y-%M-%D",
+  };
+  CHECK(mp.size() == 7);
+
+  size_t which = 99;
+  SECTION("detect") {
+    ever::instant want{2020, 7, 14, 13, 48, 18};
+    CHECK(mp.parse("2020-07-14T13:48:18.250Z", &which) == ever::instant{want.unix(), 250});
+    CHECK(which == 0);
+    CHECK(mp.parse("2020-07-14 13:48:18", &which) == want);
+    CHECK(which == 1);
+    CHECK(mp.parse("2020-07-14T13:48:18", &which) == want);
+    CHECK(which == 2);
+    CHECK(mp.parse("2020/196 13:48:18", &which) == want);
+    CHECK(which == 3);
+    CHECK(mp.parse("20200714", &which) == ever::instant{2020, 7, 14});
+    CHECK(which == 4);
+    CHECK(mp.parse("2020196", &which) == ever::instant{2020, 7, 14});
+    CHECK(which == 5);
+    CHECK(mp.parse("-0001-03-01", &which) == ever::instant{-1, 3, 1});
+    CHECK(which == 6);
+  }
+  SECTION("cache") {
+    CHECK(mp.parse("20200714", &which) == ever::instant{2020, 7, 14});
+    CHECK(which == 4);
+    CHECK(mp.parse("2020-07-14 13:48:18", &which) == ever::instant{2020, 7, 14, 13, 48, 18});
+    CHECK(which == 1);
+    for (int i = 0; i < 3; i++) {
+      CHECK(mp.parse("-0001/060 00:00:00", &which) == ever::instant{-1, 3, 1});
+      CHECK(which == 3);
+    }
+    CHECK(mp.parse("2020196", &which) == ever::instant{2020, 7, 14});
+    CHECK(which == 5);
+  }
+  SECTION("errors") {
+    auto res = mp.try_parse("2020-07-14X");
+    CHECK(res.error == ever::parse_errc::trailing_input);
+    CHECK(res.offset == 10);
+    res = mp.try_parse("2020-07-1");
+    CHECK(res.error == ever::parse_errc::unexpected_end);
+    res = mp.try_parse("2020:07");
+    CHECK(res.error == ever::parse_errc::unexpected_character);
+    CHECK(res.offset == 4);
+    res = mp.try_parse("20201314");
+    CHECK(res.error == ever::parse_errc::invalid_month);
+    res = mp.try_parse("-2020-13-14");
+    CHECK(res.error == ever::parse_errc::invalid_month);
+    CHECK(res.offset == 6);
+    CHECK_THROWS_AS(mp.parse("2020-02-30"), ever::parse_error);
+  }
+  SECTION("ambiguous") {
+    ever::multi_parser amb{"%Y-%M-%D", "%Y-%D-%M"};
+    CHECK(amb.parse("2020-01-02", &which) == ever::instant{2020, 1, 2});
+    CHECK(which == 0);
+    CHECK(amb.parse("2020-13-01", &which) == ever::instant{2020, 1, 13});
+    CHECK(which == 1);
+    CHECK(amb.parse("2020-01-02", &which) == ever::instant{2020, 1, 2});
+    CHECK(which == 0);
+  }
+}
+
+TEST_CASE("instant column") {
+  static_assert(sizeof(ever::instant) == 8);
+  static_assert(std::is_trivially_copyable<ever::instant>::value);
+
+  ever::instant_column col;
+  CHECK(col.min().is_zero());
+  long long want_lo = 0, want_hi = 0;
+  for (int i = 0; i < 1003; i++) {
+    long long ms = ((i * 7919LL) % 1000 - 500) * 86400123LL;
+    col.push_back(ever::instant{ms / 1000, int(ms % 1000)});
+    want_lo = std::min(want_lo, ms);
+    want_hi = std::max(want_hi, ms);
+  }
+  CHECK(col.size() == 1003);
+  CHECK(col.min().diff_millis(ever::instant{}) == want_lo);
+  CHECK(col.max().diff_millis(ever::instant{}) == want_hi);
+
+  ever::instant from{1970, 1, 1}, to{1971, 1, 1};
+  std::vector<uint64_t> bits((col.size() + 63) / 64);
+  size_t count = col.filter(from, to, bits.data());
+  size_t want = 0;
+  int mismatch = 0;
+  for (size_t i = 0; i < col.size(); i++) {
+    bool in = col[i] >= from && col[i] < to;
+    want += in;
+    mismatch += in != bool(bits[i / 64] >> (i % 64) & 1);
+  }
+  CHECK(count == want);
+  CHECK(mismatch == 0);
+
+  count = col.before(from, bits.data());
+  want = 0;
+  mismatch = 0;
+  for (size_t i = 0; i < col.size(); i++) {
+    bool in = col[i] < from;
+    want += in;
+    mismatch += in != bool(bits[i / 64] >> (i % 64) & 1);
+  }
+  CHECK(count == want);
+  CHECK(mismatch == 0);
+
+  ever::instant_column gps;
+  gps.push_back(ever::instant{1483228800}.to_gps());
+  gps.push_back(ever::instant{1483228800});
+  CHECK(gps[0] == gps[1]);
+}
+
+TEST_CASE("sort") {
+  std::vector<ever::instant> values;
+  unsigned long long seed = 42;
+  for (int i = 0; i < 300000; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    long long ms = static_cast<long long>(seed >> 20) % 4000000000000LL - 2000000000000LL;
+    values.push_back(ever::instant{ms / 1000, int(ms % 1000)});
+  }
+  auto want = values;
+  std::sort(want.begin(), want.end());
+
+  SECTION("radix") {
+    ever::sort(values.data(), values.size());
+    CHECK(values == want);
+  }
+  SECTION("parallel") {
+    ever::sort(values.data(), values.size(), 4);
+    CHECK(values == want);
+  }
+  SECTION("records") {
+    struct event {
+      ever::instant when;
+      int id;
+    };
+    std::vector<event> events;
+    for (int i = 0; i < 1000; i++) {
+      events.push_back(event{ever::instant{1594734498LL + (i * 37) % 100}, i});
+    }
+    ever::sort_by(events.data(), events.size(), [](const event &e) { return e.when; });
+    int unordered = 0;
+    for (size_t i = 1; i < events.size(); i++) {
+      auto &a = events[i-1], &b = events[i];
+      unordered += b.when < a.when || (b.when == a.when && b.id < a.id);
+    }
+    CHECK(unordered == 0);
+  }
+  SECTION("merge") {
+    std::vector<ever::instant> a{ever::instant{1}, ever::instant{3}, ever::instant{5}};
+    std::vector<ever::instant> b;
+    std::vector<ever::instant> c{ever::instant{0}, ever::instant{3}, ever::instant{9}};
+    const ever::instant* runs[] = {a.data(), b.data(), c.data()};
+    size_t sizes[] = {a.size(), b.size(), c.size()};
+    std::vector<ever::instant> out(6);
+    ever::merge_runs(runs, sizes, 3, out.data());
+    std::vector<long long> got;
+    for (auto w: out) {
+      got.push_back(w.unix());
+    }
+    CHECK(got == std::vector<long long>{0, 1, 3, 3, 5, 9});
+  }
+}
+
+TEST_CASE("add dates") {
+  ever::instant t{2020, 3, 15, 13, 48, 18};
+  SECTION("closed form") {
+    CHECK(t.add(0, -1, -20) == ever::instant{2020, 1, 26, 13, 48, 18});
+    CHECK(t.add(0, 0, -366) == ever::instant{2019, 3, 15, 13, 48, 18});
+    CHECK(t.add(0, 11, 0) == ever::instant{2021, 2, 15, 13, 48, 18});
+    CHECK(t.add(0, -1, 15) == ever::instant{2020, 3, 1, 13, 48, 18});
+    CHECK(t.add(0, 14, -20) == ever::instant{2021, 4, 25, 13, 48, 18});
+    CHECK(t.add(-2000, -24000, -1000000000) == ever::instant{ever::instant{-1980, 3, 15, 13, 48, 18}.unix() - 1000000000LL * 86400});
+    CHECK(ever::instant{-1, -500}.add(0, 1, 0) == ever::instant{2678398, 500});
+  }
+  SECTION("batch") {
+    std::vector<ever::instant> in, out(2000);
+    for (int i = 0; i < 2000; i++) {
+      in.push_back(ever::instant{1500000000LL + (i / 3) * 43210LL, i % 1000});
+    }
+    int mismatch = 0;
+    for (auto [y, m, d]: {std::make_tuple(0, 0, 45), std::make_tuple(0, 1, 0), std::make_tuple(-1, 13, -31)}) {
+      ever::add_batch(in.data(), in.size(), y, m, d, out.data());
+      for (size_t i = 0; i < in.size(); i++) {
+        mismatch += out[i] != in[i].add(y, m, d);
+      }
+    }
+    CHECK(mismatch == 0);
+  }
+}
+
+TEST_CASE("floor and ceil") {
+  using ever::time_unit;
+  ever::instant t{ever::instant{2020, 7, 14, 13, 48, 18}.unix(), 250};
+  SECTION("units") {
+    CHECK(t.floor(time_unit::second) == ever::instant{2020, 7, 14, 13, 48, 18});
+    CHECK(t.floor(time_unit::minute) == ever::instant{2020, 7, 14, 13, 48, 0});
+    CHECK(t.floor(time_unit::hour) == ever::instant{2020, 7, 14, 13, 0, 0});
+    CHECK(t.floor(time_unit::day) == ever::instant{2020, 7, 14});
+    CHECK(t.floor(time_unit::week) == ever::instant{2020, 7, 12});
+    CHECK(t.floor(time_unit::week).week_day() == 1);
+    CHECK(t.floor(time_unit::month) == ever::instant{2020, 7, 1});
+    CHECK(t.floor(time_unit::year) == ever::instant{2020, 1, 1});
+
+    CHECK(t.ceil(time_unit::second) == ever::instant{2020, 7, 14, 13, 48, 19});
+    CHECK(t.ceil(time_unit::week) == ever::instant{2020, 7, 19});
+    CHECK(t.ceil(time_unit::month) == ever::instant{2020, 8, 1});
+    CHECK(ever::instant{2020, 12, 5}.ceil(time_unit::month) == ever::instant{2021, 1, 1});
+    CHECK(t.ceil(time_unit::year) == ever::instant{2021, 1, 1});
+    CHECK(ever::instant{2020, 1, 1}.ceil(time_unit::year) == ever::instant{2020, 1, 1});
+    CHECK(ever::instant{-1, -1}.floor(time_unit::day) == ever::instant{1969, 12, 31});
+    static_assert(ever::instant{2020, 7, 14, 13, 48, 18}.floor(time_unit::month) == ever::instant{2020, 7, 1}, "floor");
+  }
+  SECTION("batch") {
+    std::vector<long long> in;
+    unsigned long long seed = 7;
+    for (int i = 0; i < 5003; i++) {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      in.push_back(static_cast<long long>(seed >> 16) % 20000000000000LL - 10000000000000LL);
+    }
+    in.push_back(1LL << 55);
+    in.push_back(-(1LL << 55) - 1);
+    std::sort(in.begin(), in.begin() + 2000);
+    std::vector<long long> out(in.size());
+    int mismatch = 0;
+    for (auto u: {time_unit::second, time_unit::minute, time_unit::hour, time_unit::day, time_unit::week, time_unit::month, time_unit::year}) {
+      ever::floor_batch(in.data(), in.size(), u, out.data());
+      for (size_t i = 0; i < in.size(); i++) {
+        mismatch += out[i] != ever::bucket_start(in[i], u);
+      }
+      ever::ceil_batch(in.data(), in.size(), u, out.data());
+      for (size_t i = 0; i < in.size(); i++) {
+        long long lo = ever::bucket_start(in[i], u);
+        mismatch += out[i] != (lo == in[i] ? lo : ever::bucket_next(lo, u));
+      }
+    }
+    CHECK(mismatch == 0);
+
+    std::vector<ever::instant> ws{t, t.floor(time_unit::day)}, res(2);
+    ever::ceil_batch(ws.data(), ws.size(), time_unit::day, res.data());
+    CHECK(res[0] == ever::instant{2020, 7, 15});
+    CHECK(res[1] == ever::instant{2020, 7, 14});
+  }
+}
+
+TEST_CASE("instant range") {
+  using ever::period;
+  SECTION("seconds") {
+    ever::instant_range r{ever::instant{0}, ever::instant{10}, period::of_seconds(3)};
+    std::vector<long long> got;
+    for (auto w: r) {
+      got.push_back(w.unix());
+    }
+    CHECK(got == std::vector<long long>{0, 3, 6, 9});
+    CHECK(r.size() == 4);
+    CHECK(ever::instant_range(ever::instant{10}, ever::instant{0}, period::of_seconds(1)).empty());
+    CHECK(ever::instant_range(ever::instant{0}, ever::instant{10}, period::of_seconds(0)).empty());
+    CHECK(ever::instant_range(ever::instant{0}, ever::instant{10000000}, period{0, 1, -29, 0}).empty());
+    CHECK(ever::instant_range(ever::instant{0}, ever::instant{10000000}, period{0, -1, 45, 0}).empty());
+    CHECK(ever::instant_range(ever::instant{0}, ever::instant{10000000}, period{0, 0, 1, -1000}).size() == 116);
+  }
+  SECTION("months") {
+    ever::instant start{2020, 1, 31, 12, 0, 0};
+    ever::instant_range r{start, ever::instant{2021, 1, 1}, period::of_months(1)};
+    CHECK(r.size() == 12);
+    int mismatch = 0;
+    long long k = 0;
+    for (auto w: r) {
+      mismatch += w != start.add(0, k++, 0);
+    }
+    CHECK(mismatch == 0);
+    CHECK(r[1] == ever::instant{2020, 3, 2, 12, 0, 0});
+    CHECK(r[2] == ever::instant{2020, 3, 31, 12, 0, 0});
+    auto it = r.end();
+    --it;
+    CHECK(*it == ever::instant{2020, 12, 31, 12, 0, 0});
+    CHECK(it - r.begin() == 11);
+    CHECK(std::lower_bound(r.begin(), r.end(), ever::instant{2020, 6, 1}) - r.begin() == 5);
+  }
+  SECTION("years and days") {
+    ever::instant_range r{ever::instant{1, 1, 24, 13, 28, 17}, ever::instant{10000, 1, 1}, period::of_years(1)};
+    CHECK(r.size() == 9999);
+    int mismatch = 0;
+    int year = 1;
+    for (auto w: r) {
+      mismatch += w != ever::instant{year++, 1, 24, 13, 28, 17};
+    }
+    CHECK(mismatch == 0);
+
+    ever::instant_range days{ever::instant{2020, 2, 27}, ever::instant{2020, 3, 3}, period{0, 0, 1, 3600000}};
+    CHECK(days.size() == 5);
+    CHECK(days[2] == ever::instant{2020, 2, 29, 2, 0, 0});
+    constexpr ever::instant_range weeks{ever::instant{2020, 1, 1}, ever::instant{2021, 1, 1}, period::of_days(7)};
+    static_assert(weeks.size() == 53, "weeks");
+  }
+}
+
+TEST_CASE("recurrence") {
+  ever::instant t{2020, 7, 14, 13, 48, 18};
+  SECTION("cron") {
+    CHECK(ever::recurrence::cron("*/15 * * * *").next_after(t) == ever::instant{2020, 7, 14, 14, 0, 0});
+    CHECK(ever::recurrence::cron("0 9 * * MON-FRI").next_after(t) == ever::instant{2020, 7, 15, 9, 0, 0});
+    CHECK(ever::recurrence::cron("0 9 * * sat").next_after(t) == ever::instant{2020, 7, 18, 9, 0, 0});
+    CHECK(ever::recurrence::cron("0 0 L * *").next_after(t) == ever::instant{2020, 7, 31});
+    CHECK(ever::recurrence::cron("0 0 29 2 *").next_after(t) == ever::instant{2024, 2, 29});
+    CHECK(ever::recurrence::cron("0 0 13 * 5").next_after(t) == ever::instant{2020, 7, 17});
+    CHECK(ever::recurrence::cron("30 0 0 1 jan *").next_after(t) == ever::instant{2021, 1, 1, 0, 0, 30});
+    CHECK(ever::recurrence::cron("@monthly").next_after(t) == ever::instant{2020, 8, 1});
+    CHECK(ever::recurrence::cron("48 13 * * *").next_after(t) == ever::instant{2020, 7, 15, 13, 48, 0});
+    CHECK(ever::recurrence::cron("* * * * * *").next_after(ever::instant{t.unix(), 999}) == t.add(1));
+    CHECK(ever::recurrence::cron("59 23 31 12 *").next_after(ever::instant{2020, 12, 31, 23, 59, 0}) == ever::instant{2021, 12, 31, 23, 59, 0});
+
+    CHECK_THROWS_AS(ever::recurrence::cron("0 0 30 2 *"), ever::parse_error);
+    CHECK_THROWS_AS(ever::recurrence::cron("0 0 * *"), ever::parse_error);
+    CHECK_THROWS_AS(ever::recurrence::cron("60 * * * *"), ever::parse_error);
+    CHECK_THROWS_AS(ever::recurrence::cron("0 0 * * FOO"), ever::parse_error);
+  }
+  SECTION("rrule") {
+    CHECK(ever::recurrence::rrule("FREQ=DAILY;BYHOUR=9,17").next_after(t) == ever::instant{2020, 7, 14, 17, 0, 0});
+    CHECK(ever::recurrence::rrule("FREQ=WEEKLY").next_after(t) == ever::instant{2020, 7, 20});
+    CHECK(ever::recurrence::rrule("RRULE:FREQ=MONTHLY;BYMONTHDAY=-1;BYHOUR=23;BYMINUTE=30").next_after(t) == ever::instant{2020, 7, 31, 23, 30, 0});
+    CHECK(ever::recurrence::rrule("FREQ=MONTHLY;BYDAY=FR;BYMONTHDAY=13").next_after(t) == ever::instant{2020, 11, 13});
+    CHECK(ever::recurrence::rrule("FREQ=YEARLY;BYMONTH=3").next_after(t) == ever::instant{2021, 3, 1});
+    CHECK(ever::recurrence::rrule("FREQ=YEARLY").next_after(t) == ever::instant{2021, 1, 1});
+    CHECK(ever::recurrence::rrule("FREQ=YEARLY;BYDAY=MO").next_after(t) == ever::instant{2020, 7, 20});
+    CHECK(ever::recurrence::rrule("FREQ=YEARLY;BYMONTHDAY=15").next_after(t) == ever::instant{2020, 7, 15});
+    CHECK_THROWS_AS(ever::recurrence::rrule("FREQ=DAILY;INTERVAL=2"), ever::parse_error);
+    CHECK_THROWS_AS(ever::recurrence::rrule("FREQ=DAILY;COUNT=2"), ever::parse_error);
+    CHECK_THROWS_AS(ever::recurrence::rrule("BYHOUR=2"), ever::parse_error);
+  }
+  SECTION("scan") {
+    std::vector<ever::recurrence> rules{
+      ever::recurrence::cron("*/7 3-5,22 * * *"),
+      ever::recurrence::cron("0 12 1,15 * TUE"),
+      ever::recurrence::cron("5 4 L * *"),
+      ever::recurrence::rrule("FREQ=MONTHLY;BYDAY=MO,WE;BYHOUR=8"),
+    };
+    std::vector<ever::instant> next(rules.size());
+    int mismatch = 0;
+    for (long long at = 1577836800; at < 1577836800 + 400LL * 86400; at += 86400 * 9 + 3917) {
+      ever::next_after(rules.data(), rules.size(), ever::instant{at}, next.data());
+      for (size_t i = 0; i < rules.size(); i++) {
+        // no instant of the rule between at and its next one: the next
+        // instant after the minute before the found one is the found one.
+        auto w = next[i];
+        mismatch += !(ever::instant{at} < w);
+        mismatch += rules[i].next_after(w.add(-1)) != w;
+        mismatch += rules[i].next_after(ever::instant{at}) != w;
+        auto after = rules[i].next_after(w);
+        mismatch += !(w < after);
+      }
+    }
+    CHECK(mismatch == 0);
+  }
+}
+
+TEST_CASE("timer wheel") {
+  using expired = ever::timer_wheel::expired;
+  ever::instant start{2020, 1, 1, 0, 0, 0};
+  SECTION("order") {
+    ever::timer_wheel wheel{start};
+    std::vector<expired> out;
+    wheel.schedule(start.add(10), 1);
+    wheel.schedule(start.add(2), 2);
+    wheel.schedule(ever::instant{start.unix(), 5}, 3);
+    wheel.schedule(start, 4);
+    wheel.schedule(start.add(86400 * 1000), 5);
+    CHECK(wheel.size() == 5);
+    CHECK(wheel.advance_to(start.add(2), out) == 3);
+    REQUIRE(out.size() == 3);
+    CHECK(out[0].data == 4);
+    CHECK(out[1].data == 3);
+    CHECK(out[1].deadline == ever::instant{start.unix(), 5});
+    CHECK(out[2].data == 2);
+    CHECK(wheel.now() == start.add(2));
+    CHECK(wheel.advance_to(start.add(9), out) == 0);
+    CHECK(wheel.advance_to(start, out) == 0);
+    CHECK(wheel.now() == start.add(9));
+    CHECK(wheel.advance_to(start.add(86400 * 999), out) == 1);
+    CHECK(out.back().data == 1);
+    CHECK(wheel.advance_to(start.add(86400 * 1000), out) == 1);
+    CHECK(out.back().data == 5);
+    CHECK(wheel.size() == 0);
+  }
+  SECTION("past deadlines") {
+    ever::timer_wheel wheel{ever::instant{1}};
+    std::vector<expired> out;
+    wheel.schedule(ever::instant{0, 995}, 1);
+    wheel.schedule(ever::instant{0, 990}, 2);
+    wheel.schedule(ever::instant{0, 999}, 3);
+    wheel.schedule(ever::instant{0, 990}, 4);
+    wheel.schedule(ever::instant{1, 2}, 5);
+    CHECK(wheel.advance_to(ever::instant{1, 2}, out) == 5);
+    std::vector<uint64_t> got;
+    for (auto& e: out) {
+      got.push_back(e.data);
+    }
+    CHECK(got == std::vector<uint64_t>{2, 4, 1, 3, 5});
+  }
+  SECTION("cancel") {
+    ever::timer_wheel wheel{start};
+    std::vector<expired> out;
+    auto a = wheel.schedule(start.add(1), 1);
+    auto b = wheel.schedule(start.add(1), 2);
+    CHECK(wheel.cancel(a));
+    CHECK_FALSE(wheel.cancel(a));
+    auto c = wheel.schedule(start.add(1), 3);
+    CHECK(c != a);
+    CHECK_FALSE(wheel.cancel(a));
+    CHECK(wheel.advance_to(start.add(1), out) == 2);
+    CHECK(out[0].data == 2);
+    CHECK(out[1].data == 3);
+    CHECK_FALSE(wheel.cancel(b));
+  }
+  SECTION("random") {
+    ever::timer_wheel wheel{ever::instant{-1000}};
+    std::vector<std::pair<ever::instant, uint64_t>> want;
+    std::vector<ever::timer_wheel::timer_id> ids;
+    uint64_t seed = 7;
+    auto next = [&] {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      return seed >> 33;
+    };
+    for (uint64_t i = 0; i < 20000; i++) {
+      long long ms = -1000000 + static_cast<long long>(next() % 4000000000ULL);
+      ever::instant w{ms / 1000 - (ms % 1000 < 0), static_cast<int>((ms % 1000 + 1000) % 1000)};
+      ids.push_back(wheel.schedule(w, i));
+      want.emplace_back(w, i);
+    }
+    for (uint64_t i = 0; i < want.size(); i += 3) {
+      CHECK(wheel.cancel(ids[i]));
+    }
+    std::vector<std::pair<ever::instant, uint64_t>> kept;
+    for (uint64_t i = 0; i < want.size(); i++) {
+      if (i % 3) {
+        kept.push_back(want[i]);
+      }
+    }
+    std::stable_sort(kept.begin(), kept.end(), [](auto &x, auto &y) { return x.first < y.first; });
+    std::vector<expired> out;
+    ever::instant w{-1000};
+    int late = 0;
+    while (wheel.size()) {
+      w = w.add(1 + next() % 200000);
+      size_t before = out.size();
+      wheel.advance_to(w, out);
+      for (size_t i = before; i < out.size(); i++) {
+        late += out[i].deadline > w;
+      }
+    }
+    CHECK(late == 0);
+    REQUIRE(out.size() == kept.size());
+    int mismatch = 0;
+    for (size_t i = 0; i < out.size(); i++) {
+      mismatch += out[i].deadline != kept[i].first;
+    }
+    CHECK(mismatch == 0);
+  }
 }
@@ -5,12 +5,13 @@
 #include "ever.h"
 
 void iter_dates(int from, int to) {
-  for (int i = from; i <= to; i++) {
+  ever::instant_range years{ever::instant{from, 1, 24, 13, 28, 17}, ever::instant{to+1, 1, 1}, ever::period::of_years(1)};
+  int i = from;
+  for (auto it: years) {
     std::string leapy = "----";
     if (ever::is_leap(i)) {
       leapy = "leap";
     }
-    ever::instant it{i, 1, 24, 13, 28, 17};
     std::cout << std::setfill('0')
       << std::setw(4) << i
       << "-01-24 13:28:17"
@@ -21,6 +22,7 @@ void iter_dates(int from, int to) {
       << ","
       << leapy
       << std::endl;
+    i++;
   }
 }
 
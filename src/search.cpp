@@ -0,0 +1,125 @@
+// ever-search prints the lines of a log file sorted by time whose timestamp
+// is in [from, to).
+//
+//   ever-search [-c column] [-n] -p pattern file from to
+//
+// The timestamp of each line starts column bytes after the beginning of the
+// line. from and to are parsed with the same pattern. The file is mapped in
+// memory and searched by binary search, so only a few pages are read before
+// the output starts. With -n, only the byte offsets of the range are printed.
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ever.h"
+
+// read_int reads a whole decimal number in [lo, hi].
+static bool read_int(const char* str, long lo, long hi, long &v) {
+  char* end;
+  errno = 0;
+  v = std::strtol(str, &end, 10);
+  return end != str && !*end && !errno && v >= lo && v <= hi;
+}
+
+static void usage() {
+  std::cerr << "usage: ever-search [-c column] [-n] -p pattern file from to" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  std::string pattern;
+  size_t column = 0;
+  long v;
+  bool offsets = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:np:")) != -1) {
+    switch (opt) {
+      case 'c':
+      if (!read_int(optarg, 0, LONG_MAX, v)) {
+        usage();
+        return 2;
+      }
+      column = v;
+      break;
+      case 'n':
+      offsets = true;
+      break;
+      case 'p':
+      pattern = optarg;
+      break;
+      default:
+      usage();
+      return 2;
+    }
+  }
+  if (pattern.empty() || argc - optind != 3) {
+    usage();
+    return 2;
+  }
+
+  ever::instant from, to;
+  try {
+    ever::parser p(pattern);
+    from = p.parse(argv[optind+1]);
+    to = p.parse(argv[optind+2]);
+  } catch (const ever::parse_error &e) {
+    std::cerr << "ever-search: " << e.what() << std::endl;
+    return 2;
+  }
+
+  const char* file = argv[optind];
+  int fd = ::open(file, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "ever-search: " << file << ": " << std::strerror(errno) << std::endl;
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    std::cerr << "ever-search: " << file << ": " << std::strerror(errno) << std::endl;
+    return 1;
+  }
+  size_t size = st.st_size;
+  const char* data = "";
+  if (size) {
+    void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+      std::cerr << "ever-search: mmap: " << std::strerror(errno) << std::endl;
+      return 1;
+    }
+    madvise(ptr, size, MADV_RANDOM);
+    data = static_cast<const char*>(ptr);
+  }
+
+  ever::parser p(pattern);
+  auto range = ever::search_lines(std::string_view(data, size), p, column, from, to);
+  int rc = 0;
+  if (offsets) {
+    std::cout << range.first << " " << range.last << std::endl;
+  } else {
+    const char* ptr = data + range.first;
+    size_t len = range.last - range.first;
+    while (len) {
+      ssize_t n = ::write(STDOUT_FILENO, ptr, len);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        std::cerr << "ever-search: write: " << std::strerror(errno) << std::endl;
+        rc = 1;
+        break;
+      }
+      ptr += n;
+      len -= n;
+    }
+  }
+  if (size) {
+    munmap(const_cast<char*>(data), size);
+  }
+  ::close(fd);
+  return rc;
+}